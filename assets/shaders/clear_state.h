@@ -0,0 +1,17 @@
+#ifndef CLEAR_STATE_H_
+#define CLEAR_STATE_H_
+
+// Per-tile fast clear metadata. A non-zero entry means the tile logically holds the clear value
+// in fb_info, and VRAM contents for that tile are stale until resolved.
+
+layout(std430, set = 0, binding = CLEAR_COLOR_BUFFER) buffer ClearColorTiles
+{
+	uint clear_color_tiles[];
+};
+
+layout(std430, set = 0, binding = CLEAR_DEPTH_BUFFER) buffer ClearDepthTiles
+{
+	uint clear_depth_tiles[];
+};
+
+#endif
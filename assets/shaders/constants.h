@@ -4,9 +4,6 @@
 const int SUBPIXELS_LOG2 = 3;
 const int PRIMITIVE_RIGHT_MAJOR_BIT = (1 << 0);
 
-const int MAX_PRIMITIVES = 0x4000;
-const int TILE_BINNING_STRIDE = MAX_PRIMITIVES / 32;
-const int TILE_BINNING_STRIDE_COARSE = TILE_BINNING_STRIDE / 32;
 const int MAX_WIDTH = 2048;
 const int MAX_HEIGHT = 2048;
 
@@ -16,14 +13,9 @@ const int MAX_HEIGHT = 2048;
 
 const int TILE_WIDTH = TILE_SIZE;
 const int TILE_HEIGHT = TILE_SIZE;
-const int MAX_TILES_X = MAX_WIDTH / TILE_WIDTH;
-const int MAX_TILES_Y = MAX_HEIGHT / TILE_HEIGHT;
 const int TILE_DOWNSAMPLE = 8;
 const int TILE_DOWNSAMPLE_LOG2 = 3;
-const int MAX_TILES_X_LOW_RES = MAX_WIDTH / (TILE_DOWNSAMPLE * TILE_WIDTH);
-const int MAX_TILES_Y_LOW_RES = MAX_HEIGHT / (TILE_DOWNSAMPLE * TILE_HEIGHT);
 const int RASTER_ROUNDING = (1 << (SUBPIXELS_LOG2 + 16)) - 1;
-const int TILE_INSTANCE_STRIDE = 0x10000;
 const int MAX_RENDER_STATES = 1024;
 const int VRAM_SIZE = 64 * 1024 * 1024;
 
@@ -17,6 +17,25 @@ layout(set = 2, binding = 0, std140) uniform FBInfo
 	int depth_width;
 	int depth_height;
 	int depth_stride;
+
+	int tile_binning_stride;
+	int tile_binning_stride_coarse;
+
+	int color_clear_value;
+	int depth_clear_value;
+
+	// Row pitch in tiles of per-tile buffers, sized for the configured framebuffers.
+	int tile_grid_stride;
+	int tile_grid_stride_low_res;
+
+	// HIZ_CULL_* bits, which depth tests binning may cull against the per-tile depth range.
+	int hiz_cull_mode;
+
+	// Differs between consecutive split batches, see the touched tile list in binning.comp.
+	uint touched_tile_stamp;
 } fb_info;
 
+#define HIZ_CULL_LESS_BIT 1
+#define HIZ_CULL_GREATER_BIT 2
+
 #endif
\ No newline at end of file
@@ -24,4 +24,9 @@ struct PrimitiveSetupAttr
 	i16vec2 uv_offset;
 };
 
+struct PrimitiveSetupBBox
+{
+	int16_t min_x, max_x, min_y, max_y;
+};
+
 #endif
\ No newline at end of file
@@ -207,4 +207,26 @@ uint interpolate_z(uint primitive_index, int x, int y, ivec2 interpolation_base)
 }
 #endif
 
+#if defined(PRIMITIVE_SETUP_POS_BUFFER) && defined(PRIMITIVE_SETUP_ATTR_BUFFER)
+// Bounds of 0xffff * fz in interpolate_z() over the pixels in [start, end), before rounding and clamping.
+// Z is a plane, so the extremes are found in the corners. The bounds are widened to cover
+// rounding differences against the per-pixel evaluation, which may be contracted differently.
+vec2 interpolate_z_range(uint primitive_index, ivec2 start, ivec2 end)
+{
+    ivec2 interpolation_base = get_interpolation_base(primitive_index);
+    ivec2 d_lo = (start << SUBPIXELS_LOG2) - interpolation_base;
+    ivec2 d_hi = ((end - 1) << SUBPIXELS_LOG2) - interpolation_base;
+
+    float z = primitives_attr[primitive_index].z;
+    vec2 x_terms = primitives_attr[primitive_index].dzdx * vec2(d_lo.x, d_hi.x);
+    vec2 y_terms = primitives_attr[primitive_index].dzdy * vec2(d_lo.y, d_hi.y);
+
+    float lo = z + min(x_terms.x, x_terms.y) + min(y_terms.x, y_terms.y);
+    float hi = z + max(x_terms.x, x_terms.y) + max(y_terms.x, y_terms.y);
+    float magnitude = abs(z) + max(abs(x_terms.x), abs(x_terms.y)) + max(abs(y_terms.x), abs(y_terms.y));
+    float slack = 1.0 + float(0xffff) * 1e-6 * magnitude;
+    return float(0xffff) * vec2(lo, hi) + vec2(-slack, slack);
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -3,9 +3,9 @@
 
 #include "constants.h"
 
-layout(std430, set = 0, binding = RENDER_STATE_INDEX_BUFFER) uniform ROPStateIndex
+layout(std430, set = 0, binding = RENDER_STATE_INDEX_BUFFER) readonly buffer ROPStateIndex
 {
-	uint16_t render_state_indices[MAX_PRIMITIVES];
+	uint16_t render_state_indices[];
 };
 
 struct RenderState
@@ -29,6 +29,16 @@ struct RenderState
 	int texture_offset[8];
 };
 
+// Depth tests in the low bits of depth_state, the top bit enables depth writes.
+#define ROP_Z_ALWAYS 0u
+#define ROP_Z_LE 1u
+#define ROP_Z_LEQ 2u
+#define ROP_Z_GE 3u
+#define ROP_Z_GEQ 4u
+#define ROP_Z_EQ 5u
+#define ROP_Z_NEQ 6u
+#define ROP_Z_NEVER 7u
+
 layout(std430, set = 0, binding = RENDER_STATE_BUFFER) uniform RenderStates
 {
 	RenderState render_states[MAX_RENDER_STATES];
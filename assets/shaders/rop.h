@@ -13,15 +13,6 @@ uint current_z;
 bool dirty_color = false;
 bool dirty_depth = false;
 
-#define ROP_Z_ALWAYS 0u
-#define ROP_Z_LE 1u
-#define ROP_Z_LEQ 2u
-#define ROP_Z_GE 3u
-#define ROP_Z_GEQ 4u
-#define ROP_Z_EQ 5u
-#define ROP_Z_NEQ 6u
-#define ROP_Z_NEVER 7u
-
 #define ROP_BLEND_REPLACE 0u
 #define ROP_BLEND_ADDITIVE 1u
 #define ROP_BLEND_ALPHA 2u
@@ -0,0 +1,35 @@
+#version 450
+
+// Scans out the color framebuffer straight from VRAM, converting ARGB1555 to the render target format.
+// Sampling is nearest, as the retro GPU has no display filter.
+
+#extension GL_EXT_shader_16bit_storage : require
+
+#include "constants.h"
+#include "pixel_conv.h"
+
+layout(location = 0) in highp vec2 vUV;
+layout(location = 0) out vec4 FragColor;
+
+layout(push_constant, std430) uniform Registers
+{
+    uint offset;
+    uint width;
+    uint height;
+    uint stride;
+} registers;
+
+layout(set = 0, binding = 0, std430) readonly buffer VRAM
+{
+    uint16_t vram[];
+};
+
+void main()
+{
+    uvec2 resolution = uvec2(registers.width, registers.height);
+    uvec2 coord = min(uvec2(vUV * vec2(resolution)), resolution - 1u);
+    uint index = registers.offset + coord.x + coord.y * registers.stride;
+    index &= (VRAM_SIZE >> 1) - 1;
+    uvec4 color = expand_argb1555(unpack_argb1555(uint(vram[index])));
+    FragColor = vec4(color) / 255.0;
+}
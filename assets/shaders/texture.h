@@ -36,13 +36,20 @@ uvec4 filter_trilinear(uvec4 a, uvec4 b, int l)
 	return (res + 0x80u) >> 8u;
 }
 
-// Can add way more formats here and palette support.
+// Can add way more formats here.
+// The low two bits are log2 of texels per 16-bit word, or of indices per word for VQ.
 const uint TEXTURE_FMT_ARGB1555 = 0;
 const uint TEXTURE_FMT_I8 = 1;
+const uint TEXTURE_FMT_PAL4 = 2;
 const uint TEXTURE_FMT_LA88 = 4;
+const uint TEXTURE_FMT_PAL8 = 5;
+const uint TEXTURE_FMT_VQ = 9;
 const uint TEXTURE_FMT_FILTER_LINEAR_BIT = 0x80u;
 const uint TEXTURE_FMT_FILTER_MIP_LINEAR_BIT = 0x40u;
 
+// Paletted and VQ formats find their ARGB1555 CLUT or codebook at this texture offset instead of a mip level.
+const int TEXTURE_PALETTE_LEVEL = 7;
+
 int round_up_bits(int u, int subsample)
 {
 	return (u + ((1 << subsample) - 1)) >> subsample;
@@ -64,6 +71,23 @@ int compute_offset(int x, int y, int blocks_x, int subsample)
 	return offset;
 }
 
+// Palette indices are packed from the low bits up, 2 or 4 per word.
+uvec4 sample_palette(int palette_offset, uint raw_sample, int x, int subsample)
+{
+	int bits = 16 >> subsample;
+	uint index = bitfieldExtract(raw_sample, bits * (x & ((1 << subsample) - 1)), bits);
+	int offset = (palette_offset + int(index)) & ((VRAM_SIZE >> 1) - 1);
+	return expand_argb1555(unpack_argb1555(uint(vram_data[offset])));
+}
+
+// VQ codebook entries are 2x2 ARGB1555 texels, and each index covers a 2x2 texel block of the level.
+uvec4 sample_codebook(int codebook_offset, uint raw_sample, ivec2 uv)
+{
+	uint index = bitfieldExtract(raw_sample, 8 * ((uv.x >> 1) & 1), 8);
+	int offset = (codebook_offset + 4 * int(index) + 2 * (uv.y & 1) + (uv.x & 1)) & ((VRAM_SIZE >> 1) - 1);
+	return expand_argb1555(unpack_argb1555(uint(vram_data[offset])));
+}
+
 uvec4 sample_texture_lod(uint variant_index, ivec2 base_uv, int lod, uint fmt)
 {
 	int tex_width = int(render_states[variant_index].texture_width);
@@ -82,12 +106,15 @@ uvec4 sample_texture_lod(uint variant_index, ivec2 base_uv, int lod, uint fmt)
 	uv >>= 5;
 
 	int subsample = int(fmt & 3u);
-	mip_width = round_up_bits(mip_width, subsample);
+	// VQ levels are addressed as a map of indices at half resolution.
+	int index_shift = (fmt & 0x3fu) == TEXTURE_FMT_VQ ? 1 : 0;
+	mip_width = round_up_bits(round_up_bits(mip_width, index_shift), subsample);
 	int blocks_x = (mip_width + 7) >> 3;
 
 	ivec2 uv0 = clamp(uv, tex_clamp.xy, tex_clamp.zw) & tex_mask;
 	int offset = render_states[variant_index].texture_offset[lod] >> 1;
-	int offset0 = (offset + compute_offset(uv0.x, uv0.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
+	ivec2 index_uv0 = uv0 >> index_shift;
+	int offset0 = (offset + compute_offset(index_uv0.x, index_uv0.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
 	uint raw_sample0 = uint(vram_data[offset0]);
 
 	uint raw_sample1, raw_sample2, raw_sample3;
@@ -97,9 +124,12 @@ uvec4 sample_texture_lod(uint variant_index, ivec2 base_uv, int lod, uint fmt)
 		uv1 = clamp(uv + ivec2(1, 0), tex_clamp.xy, tex_clamp.zw) & tex_mask;
 		uv2 = clamp(uv + ivec2(0, 1), tex_clamp.xy, tex_clamp.zw) & tex_mask;
 		uv3 = clamp(uv + ivec2(1), tex_clamp.xy, tex_clamp.zw) & tex_mask;
-		int offset1 = (offset + compute_offset(uv1.x, uv1.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
-		int offset2 = (offset + compute_offset(uv2.x, uv2.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
-		int offset3 = (offset + compute_offset(uv3.x, uv3.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
+		ivec2 index_uv1 = uv1 >> index_shift;
+		ivec2 index_uv2 = uv2 >> index_shift;
+		ivec2 index_uv3 = uv3 >> index_shift;
+		int offset1 = (offset + compute_offset(index_uv1.x, index_uv1.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
+		int offset2 = (offset + compute_offset(index_uv2.x, index_uv2.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
+		int offset3 = (offset + compute_offset(index_uv3.x, index_uv3.y, blocks_x, subsample)) & ((VRAM_SIZE >> 1) - 1);
 		raw_sample1 = uint(vram_data[offset1]);
 		raw_sample2 = uint(vram_data[offset2]);
 		raw_sample3 = uint(vram_data[offset3]);
@@ -138,6 +168,34 @@ uvec4 sample_texture_lod(uint variant_index, ivec2 base_uv, int lod, uint fmt)
 			sample3 = uvec4((raw_sample3 >> (8u * (uv3.x & 1u))) & 0xffu);
 		}
 		break;
+
+	case TEXTURE_FMT_PAL4:
+	case TEXTURE_FMT_PAL8:
+	{
+		// Filtering happens after the lookup, on the colors.
+		int palette_offset = render_states[variant_index].texture_offset[TEXTURE_PALETTE_LEVEL] >> 1;
+		sample0 = sample_palette(palette_offset, raw_sample0, uv0.x, subsample);
+		if (linear_filter)
+		{
+			sample1 = sample_palette(palette_offset, raw_sample1, uv1.x, subsample);
+			sample2 = sample_palette(palette_offset, raw_sample2, uv2.x, subsample);
+			sample3 = sample_palette(palette_offset, raw_sample3, uv3.x, subsample);
+		}
+		break;
+	}
+
+	case TEXTURE_FMT_VQ:
+	{
+		int codebook_offset = render_states[variant_index].texture_offset[TEXTURE_PALETTE_LEVEL] >> 1;
+		sample0 = sample_codebook(codebook_offset, raw_sample0, uv0);
+		if (linear_filter)
+		{
+			sample1 = sample_codebook(codebook_offset, raw_sample1, uv1);
+			sample2 = sample_codebook(codebook_offset, raw_sample2, uv2);
+			sample3 = sample_codebook(codebook_offset, raw_sample3, uv3);
+		}
+		break;
+	}
 	}
 
 	if (linear_filter)
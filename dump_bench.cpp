@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <vector>
 #include <random>
+#include <cmath>
 #include <assert.h>
 
 #include "global_managers.hpp"
@@ -153,10 +154,118 @@ bool StreamReader::parse_uint(uint32_t &value)
 
 bool StreamReader::parse_primitive(PrimitiveSetup &setup)
 {
-	if (offset + sizeof(setup) > size)
+	// The bounding box is not part of the dump format, it is derived from the position data.
+	if (offset + sizeof(setup.pos) + sizeof(setup.attr) > size)
 		return false;
-	memcpy(&setup, blob + offset, sizeof(setup));
-	offset += sizeof(setup);
+	memcpy(&setup.pos, blob + offset, sizeof(setup.pos));
+	offset += sizeof(setup.pos);
+	memcpy(&setup.attr, blob + offset, sizeof(setup.attr));
+	offset += sizeof(setup.attr);
+	compute_primitive_bbox(setup);
+	return true;
+}
+
+static PrimitiveSetupBBox clip_bbox_scissor(const PrimitiveSetupBBox &bbox, int width, int height)
+{
+	// Matches the scissor handling of triangle_setup.comp, with the empty box it stores.
+	PrimitiveSetupBBox clipped;
+	clipped.min_x = int16_t(std::max<int>(bbox.min_x, 0));
+	clipped.max_x = int16_t(std::min<int>(bbox.max_x, width - 1));
+	clipped.min_y = int16_t(std::max<int>(bbox.min_y, 0));
+	clipped.max_y = int16_t(std::min<int>(bbox.max_y, height - 1));
+	if (clipped.min_x > clipped.max_x || clipped.min_y > clipped.max_y)
+		clipped = { 0, -1, 0, -1 };
+	return clipped;
+}
+
+// Sets up random triangles with triangle_setup.comp and compares the result against setup_clipped_triangles().
+// Triangles range from tiny to far larger than the guard band, and cross the near, far and W planes.
+static bool verify_triangle_setup(RasterizerGPU &rasterizer, unsigned num_triangles)
+{
+	constexpr unsigned MAX_CLIPPED_PRIMITIVES = 8;
+	constexpr int WIDTH = 640;
+	constexpr int HEIGHT = 480;
+	const ViewportTransform vp = { 0.0f, 0.0f, float(WIDTH), float(HEIGHT), 0.0f, 1.0f };
+	rasterizer.set_scissor(0, 0, WIDTH, HEIGHT);
+
+	std::mt19937 rnd(1337);
+	std::uniform_real_distribution<float> center_dist(-1.5f, 1.5f);
+	std::uniform_real_distribution<float> depth_dist(-0.5f, 1.5f);
+	std::uniform_real_distribution<float> w_dist(-0.5f, 4.0f);
+	std::uniform_real_distribution<float> extent_dist(-8.0f, 2.0f);
+	std::uniform_real_distribution<float> offset_dist(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> uv_dist(-64.0f, 64.0f);
+	std::uniform_real_distribution<float> color_dist(0.0f, 1.0f);
+
+	std::vector<Vertex> vertices(3 * num_triangles);
+	std::vector<uint32_t> indices(3 * num_triangles);
+	for (unsigned i = 0; i < num_triangles; i++)
+	{
+		float center[3] = { center_dist(rnd), center_dist(rnd), depth_dist(rnd) };
+		float extent = std::exp2(extent_dist(rnd));
+		for (unsigned j = 0; j < 3; j++)
+		{
+			auto &v = vertices[3 * i + j];
+			v.w = w_dist(rnd);
+			v.x = (center[0] + extent * offset_dist(rnd)) * v.w;
+			v.y = (center[1] + extent * offset_dist(rnd)) * v.w;
+			v.z = (center[2] + extent * offset_dist(rnd)) * v.w;
+			v.u = uv_dist(rnd);
+			v.v = uv_dist(rnd);
+			for (auto &c : v.color)
+				c = color_dist(rnd);
+			indices[3 * i + j] = 3 * i + j;
+		}
+	}
+
+	unsigned num_primitives = 0;
+	unsigned num_mismatches = 0;
+	for (auto mode : { CullMode::None, CullMode::CCWOnly, CullMode::CWOnly })
+	{
+		auto gpu_setups = rasterizer.read_back_triangle_setup(vertices.data(), unsigned(vertices.size()),
+		                                                      indices.data(), num_triangles, mode, vp);
+
+		for (unsigned i = 0; i < num_triangles; i++)
+		{
+			InputPrimitive input = {};
+			for (unsigned j = 0; j < 3; j++)
+				input.vertices[j] = vertices[3 * i + j];
+
+			PrimitiveSetup setups[MAX_CLIPPED_PRIMITIVES] = {};
+			unsigned count = setup_clipped_triangles(setups, input, mode, vp);
+			num_primitives += count;
+
+			for (unsigned j = 0; j < MAX_CLIPPED_PRIMITIVES; j++)
+			{
+				auto &gpu_setup = gpu_setups[i * MAX_CLIPPED_PRIMITIVES + j];
+				bool match;
+				if (j < count)
+				{
+					auto bbox = clip_bbox_scissor(setups[j].bbox, WIDTH, HEIGHT);
+					match = memcmp(&gpu_setup.pos, &setups[j].pos, sizeof(gpu_setup.pos)) == 0 &&
+					        memcmp(&gpu_setup.attr, &setups[j].attr, sizeof(gpu_setup.attr)) == 0 &&
+					        memcmp(&gpu_setup.bbox, &bbox, sizeof(bbox)) == 0;
+				}
+				else
+					match = gpu_setup.bbox.min_x > gpu_setup.bbox.max_x;
+
+				if (!match)
+				{
+					if (num_mismatches < 16)
+						LOGE("Triangle %u, primitive %u (of %u) differs with cull mode %d.\n", i, j, count, int(mode));
+					num_mismatches++;
+				}
+			}
+		}
+	}
+
+	if (num_mismatches != 0)
+	{
+		LOGE("Triangle setup: %u mismatching slots, %u primitives set up on the CPU.\n", num_mismatches, num_primitives);
+		return false;
+	}
+
+	LOGI("Triangle setup: all %u primitives match.\n", num_primitives);
 	return true;
 }
 
@@ -168,6 +277,14 @@ int main(int argc, char **argv)
 	std::string path;
 	unsigned tile_size = 16;
 	unsigned num_iterations = 1000;
+	bool immediate = false;
+	bool command_list = false;
+	bool deferred = false;
+	bool adaptive_tile_size = false;
+	std::string texture_format = "argb1555";
+	unsigned max_primitives = 0x4000;
+	unsigned batches_in_flight = 3;
+	unsigned verify_setup = 0;
 
 	Util::CLICallbacks cbs;
 	cbs.add("--ubershader", [&](Util::CLIParser &) { ubershader = true; });
@@ -175,10 +292,18 @@ int main(int argc, char **argv)
 	cbs.add("--async-compute", [&](Util::CLIParser &) { async_compute = true; });
 	cbs.add("--tile-size", [&](Util::CLIParser &parser) { tile_size = parser.next_uint(); });
 	cbs.add("--iterations", [&](Util::CLIParser &parser) { num_iterations = parser.next_uint(); });
+	cbs.add("--immediate", [&](Util::CLIParser &) { immediate = true; });
+	cbs.add("--command-list", [&](Util::CLIParser &) { command_list = true; });
+	cbs.add("--deferred", [&](Util::CLIParser &) { deferred = true; });
+	cbs.add("--adaptive-tile-size", [&](Util::CLIParser &) { adaptive_tile_size = true; });
+	cbs.add("--texture-format", [&](Util::CLIParser &parser) { texture_format = parser.next_string(); });
+	cbs.add("--max-primitives", [&](Util::CLIParser &parser) { max_primitives = parser.next_uint(); });
+	cbs.add("--batches-in-flight", [&](Util::CLIParser &parser) { batches_in_flight = parser.next_uint(); });
+	cbs.add("--verify-setup", [&](Util::CLIParser &parser) { verify_setup = parser.next_uint(); });
 	cbs.default_handler = [&](const char *arg) { path = arg; };
 	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
 
-	if (!parser.parse() || path.empty())
+	if (!parser.parse() || (path.empty() && verify_setup == 0))
 	{
 		LOGE("Failed to parse.\n");
 		return EXIT_FAILURE;
@@ -190,9 +315,61 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (max_primitives < 1024 || max_primitives > 262144 || (max_primitives & 1023) != 0)
+	{
+		LOGE("Max primitives must be a multiple of 1024 in range [1024, 262144].\n");
+		return EXIT_FAILURE;
+	}
+
+	if (batches_in_flight < 2 || batches_in_flight > 4)
+	{
+		LOGE("Batches in flight must be in range [2, 4].\n");
+		return EXIT_FAILURE;
+	}
+
+	TextureFormatBits texture_fmt;
+	if (texture_format == "argb1555")
+		texture_fmt = TEXTURE_FMT_ARGB1555;
+	else if (texture_format == "pal8")
+		texture_fmt = TEXTURE_FMT_PAL8;
+	else if (texture_format == "pal4")
+		texture_fmt = TEXTURE_FMT_PAL4;
+	else if (texture_format == "vq")
+		texture_fmt = TEXTURE_FMT_VQ;
+	else
+	{
+		LOGE("Texture format must be argb1555, pal8, pal4 or vq.\n");
+		return EXIT_FAILURE;
+	}
+
 	Global::init();
 	Global::filesystem()->register_protocol("assets", std::make_unique<OSFilesystem>(ASSET_DIRECTORY));
 
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to init loader.\n");
+		return EXIT_FAILURE;
+	}
+
+	Vulkan::Context ctx;
+	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create instance.\n");
+		return EXIT_FAILURE;
+	}
+
+	Vulkan::Device device;
+	device.set_context(ctx);
+
+	RasterizerGPU rasterizer;
+	rasterizer.init(device, subgroup, ubershader, async_compute, tile_size, max_primitives, batches_in_flight);
+	rasterizer.set_deferred_shading(deferred);
+	rasterizer.set_adaptive_tile_size(adaptive_tile_size);
+
+	// Verification does not need a dump, the triangles are generated.
+	if (verify_setup != 0)
+		return verify_triangle_setup(rasterizer, verify_setup) ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	auto dump_file = Global::filesystem()->open(path, FileMode::ReadOnly);
 	if (!dump_file)
 	{
@@ -228,32 +405,17 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (!Vulkan::Context::init_loader(nullptr))
-	{
-		LOGE("Failed to init loader.\n");
-		return EXIT_FAILURE;
-	}
-
-	Vulkan::Context ctx;
-	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0))
+	uint32_t color_addr = 0, depth_addr = 0;
+	if (!rasterizer.allocate_vram(width * height * 2, 64, color_addr) ||
+	    !rasterizer.allocate_vram(width * height * 2, 64, depth_addr))
 	{
-		LOGE("Failed to create instance.\n");
+		LOGE("Failed to allocate framebuffers in VRAM.\n");
 		return EXIT_FAILURE;
 	}
+	rasterizer.set_color_framebuffer(color_addr, width, height, width * 2);
+	rasterizer.set_depth_framebuffer(depth_addr, width, height, width * 2);
 
-	Vulkan::Device device;
-	device.set_context(ctx);
-
-	RasterizerGPU rasterizer;
-	rasterizer.init(device, subgroup, ubershader, async_compute, tile_size);
-
-	uint32_t addr = 0;
-	rasterizer.set_color_framebuffer(addr, width, height, width * 2);
-	addr += width * height * 2;
-	rasterizer.set_depth_framebuffer(addr, width, height, width * 2);
-	addr += width * height * 2;
-
-	std::vector<TextureDescriptor> texture_descriptors;
+	std::vector<TextureHandle> textures;
 	for (unsigned i = 0; i < num_textures; i++)
 	{
 		auto tex_path = std::string(argv[1]) + ".tex." + std::to_string(i);
@@ -274,24 +436,17 @@ int main(int argc, char **argv)
 		                                  layout.get_height(TEXTURE_BASE_LEVEL) - 1);
 		descriptor.texture_max_lod = levels - 1;
 		descriptor.texture_width = layout.get_width(TEXTURE_BASE_LEVEL);
-		descriptor.texture_fmt = TEXTURE_FMT_ARGB1555 | TEXTURE_FMT_FILTER_MIP_LINEAR_BIT | TEXTURE_FMT_FILTER_LINEAR_BIT;
-
-		addr = (addr + 63) & ~63;
+		descriptor.texture_fmt = texture_fmt | TEXTURE_FMT_FILTER_MIP_LINEAR_BIT | TEXTURE_FMT_FILTER_LINEAR_BIT;
 
+		TextureLevel texture_levels[8];
 		for (unsigned level = 0; level < levels; level++)
 		{
-			unsigned mip_width = layout.get_width(level + TEXTURE_BASE_LEVEL);
-			unsigned mip_height = layout.get_height(level + TEXTURE_BASE_LEVEL);
-			descriptor.texture_offset[level] = addr;
-			uint32_t blocks_width = (mip_width + 7) / 8;
-			uint32_t blocks_height = (mip_height + 7) / 8;
-			rasterizer.copy_texture_rgba8888_to_vram(addr,
-			                                         static_cast<const uint32_t *>(layout.data(0, level + TEXTURE_BASE_LEVEL)),
-			                                         mip_width, mip_height, TEXTURE_FMT_ARGB1555);
-			addr += blocks_width * blocks_height * 64 * sizeof(uint16_t);
+			texture_levels[level].data = static_cast<const uint32_t *>(layout.data(0, level + TEXTURE_BASE_LEVEL));
+			texture_levels[level].width = layout.get_width(level + TEXTURE_BASE_LEVEL);
+			texture_levels[level].height = layout.get_height(level + TEXTURE_BASE_LEVEL);
 		}
 
-		texture_descriptors.push_back(descriptor);
+		textures.push_back(rasterizer.create_texture(descriptor, texture_levels, levels));
 	}
 
 	struct Cache
@@ -407,24 +562,86 @@ int main(int argc, char **argv)
 
 	LOGI("Primitive count: %u\n", unsigned(commands.size()));
 
+	bool textures_fit = true;
+	const auto apply_state = [&](const Cache &command) {
+		if (!rasterizer.set_texture(textures[command.state_index]))
+			textures_fit = false;
+		rasterizer.set_combiner_mode(command.combiner_state);
+		rasterizer.set_constant_color(command.constant_color[0], command.constant_color[1], command.constant_color[2], command.constant_color[3]);
+		rasterizer.set_depth_state(command.depth_test, command.depth_write);
+		rasterizer.set_alpha_threshold(command.alpha_threshold);
+		rasterizer.set_rop_state(command.blend_state);
+	};
+
+	// Bake state blocks up front and merge consecutive primitives which share state into draws.
+	struct Draw
+	{
+		RenderStateBlock block;
+		size_t offset;
+		size_t count;
+	};
+	std::vector<PrimitiveSetup> setups;
+	std::vector<Draw> draws;
+	setups.reserve(commands.size());
+	for (auto &command : commands)
+	{
+		apply_state(command);
+		auto block = rasterizer.create_render_state_block();
+		if (!draws.empty() && draws.back().block.index == block.index)
+			draws.back().count++;
+		else
+			draws.push_back({ block, setups.size(), 1 });
+		setups.push_back(command.setup);
+	}
+
+	LOGI("Draw count: %u\n", unsigned(draws.size()));
+
+	// State blocks capture texture addresses, so every texture in the frame must stay resident.
+	if (!textures_fit)
+	{
+		LOGE("Textures do not fit in VRAM.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Keep texture uploads out of the timed iterations.
+	auto upload_fence = rasterizer.submit_texture_uploads();
+	if (upload_fence)
+		upload_fence->wait();
+
+	// Recording uploads the primitives once, so iterations only pay for the GPU passes.
+	CommandList list;
+	if (command_list)
+	{
+		rasterizer.begin_command_list();
+		for (auto &draw : draws)
+			rasterizer.rasterize_primitives(draw.block, setups.data() + draw.offset, draw.count);
+		list = rasterizer.end_command_list();
+	}
+
 	rasterizer.flush();
 	device.wait_idle();
+	rasterizer.reset_stats();
 	auto start_run = Util::get_current_time_nsecs();
 	for (unsigned i = 0; i < num_iterations; i++)
 	{
 		device.next_frame_context();
+		rasterizer.next_frame();
 		rasterizer.clear_depth();
 		rasterizer.clear_color();
-		for (auto &command : commands)
+		if (command_list)
+			rasterizer.execute_command_list(list);
+		else if (immediate)
+		{
+			for (auto &command : commands)
+			{
+				apply_state(command);
+				rasterizer.rasterize_primitives(&command.setup, 1);
+			}
+		}
+		else
 		{
-			rasterizer.set_texture_descriptor(texture_descriptors[command.state_index]);
-			rasterizer.set_combiner_mode(command.combiner_state);
-			rasterizer.set_constant_color(command.constant_color[0], command.constant_color[1], command.constant_color[2], command.constant_color[3]);
-			rasterizer.set_depth_state(command.depth_test, command.depth_write);
-			rasterizer.set_alpha_threshold(command.alpha_threshold);
-			rasterizer.set_rop_state(command.blend_state);
-			rasterizer.set_depth_state(command.depth_test, command.depth_write);
-			rasterizer.rasterize_primitives(&command.setup, 1);
+			for (auto &draw : draws)
+				rasterizer.rasterize_primitives(draw.block, setups.data() + draw.offset, draw.count);
 		}
 		rasterizer.flush();
 	}
@@ -432,5 +649,22 @@ int main(int argc, char **argv)
 	auto end_run = Util::get_current_time_nsecs();
 	LOGI("CPU time: %.3f ms / frame\n", (double(end_run - start_run) / double(num_iterations)) * 1e-6);
 
+	// Make sure the timestamps of the last frames are resolved.
+	device.next_frame_context();
+	auto stats = rasterizer.get_stats();
+	for (unsigned i = 0; i < unsigned(RasterizerStage::Count); i++)
+	{
+		auto &dist = stats.stage_time_ms[i];
+		if (dist.num_samples == 0)
+			continue;
+		LOGI("GPU %s: min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms (%u samples)\n",
+		     RasterizerGPU::get_stage_name(RasterizerStage(i)),
+		     dist.min, dist.mean, dist.p50, dist.p99, dist.num_samples);
+	}
+	LOGI("Flushes: %.1f / frame, %.0f primitives / flush, %.0f tile instances / flush, %.1f variants / flush\n",
+	     double(stats.num_flushes) / double(num_iterations),
+	     stats.primitives_per_flush.mean, stats.tile_instances_per_flush.mean,
+	     stats.shader_variants_per_flush.mean);
+
 	rasterizer.save_canvas("canvas.png");
 }
@@ -0,0 +1,102 @@
+#include "frame_encoder.hpp"
+#include "stb_image_write.h"
+#include <stdio.h>
+#include <utility>
+
+namespace RetroWarp
+{
+FrameEncoder::FrameEncoder(unsigned num_threads, unsigned max_queued_frames_)
+	: max_queued_frames(max_queued_frames_ ? max_queued_frames_ : 1)
+{
+	if (num_threads == 0)
+		num_threads = 1;
+	for (unsigned i = 0; i < num_threads; i++)
+		workers.emplace_back(&FrameEncoder::worker_loop, this);
+}
+
+FrameEncoder::~FrameEncoder()
+{
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		dead = true;
+	}
+	work_cond.notify_all();
+	for (auto &worker : workers)
+		worker.join();
+}
+
+void FrameEncoder::push(std::string path, Format format, std::vector<uint16_t> pixels, unsigned width, unsigned height)
+{
+	std::unique_lock<std::mutex> holder{lock};
+	done_cond.wait(holder, [this]() { return jobs.size() < max_queued_frames; });
+	jobs.push_back({ std::move(path), format, std::move(pixels), width, height });
+	holder.unlock();
+	work_cond.notify_one();
+}
+
+void FrameEncoder::wait_idle()
+{
+	std::unique_lock<std::mutex> holder{lock};
+	done_cond.wait(holder, [this]() { return jobs.empty() && active_jobs == 0; });
+}
+
+bool FrameEncoder::get_status() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return !failed;
+}
+
+void FrameEncoder::worker_loop()
+{
+	for (;;)
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		work_cond.wait(holder, [this]() { return dead || !jobs.empty(); });
+		if (jobs.empty())
+			return;
+
+		Job job = std::move(jobs.front());
+		jobs.pop_front();
+		active_jobs++;
+		holder.unlock();
+		// A slot in the queue opened up.
+		done_cond.notify_all();
+
+		bool ret = encode(job);
+
+		holder.lock();
+		active_jobs--;
+		if (!ret)
+			failed = true;
+		holder.unlock();
+		done_cond.notify_all();
+	}
+}
+
+bool FrameEncoder::encode(const Job &job)
+{
+	std::vector<uint8_t> rgba(job.width * job.height * 4);
+	for (size_t i = 0; i < job.pixels.size(); i++)
+	{
+		unsigned v = job.pixels[i];
+		unsigned r = (v >> 10) & 31;
+		unsigned g = (v >> 5) & 31;
+		unsigned b = (v >> 0) & 31;
+		rgba[4 * i + 0] = uint8_t((r << 3) | (r >> 2));
+		rgba[4 * i + 1] = uint8_t((g << 3) | (g >> 2));
+		rgba[4 * i + 2] = uint8_t((b << 3) | (b >> 2));
+		rgba[4 * i + 3] = 0xff;
+	}
+
+	if (job.format == Format::PNG)
+		return stbi_write_png(job.path.c_str(), job.width, job.height, 4, rgba.data(), job.width * 4) != 0;
+
+	FILE *file = fopen(job.path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ret = fwrite(rgba.data(), 1, rgba.size(), file) == rgba.size();
+	if (fclose(file) != 0)
+		ret = false;
+	return ret;
+}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Background encoder for captured frames.
+// Frames are queued as raw ARGB1555 pixels, unpacked and written out on worker threads.
+
+namespace RetroWarp
+{
+class FrameEncoder
+{
+public:
+	enum class Format
+	{
+		// One PNG per frame.
+		PNG,
+		// Tightly packed RGBA8 pixels, one file per frame.
+		Raw
+	};
+
+	// max_queued_frames bounds memory use. push() blocks while that many frames are waiting.
+	FrameEncoder(unsigned num_threads, unsigned max_queued_frames);
+	~FrameEncoder();
+
+	void push(std::string path, Format format, std::vector<uint16_t> pixels, unsigned width, unsigned height);
+
+	// Blocks until every queued frame has been written.
+	void wait_idle();
+
+	// Returns false if writing any frame failed so far.
+	bool get_status() const;
+
+private:
+	struct Job
+	{
+		std::string path;
+		Format format;
+		std::vector<uint16_t> pixels;
+		unsigned width;
+		unsigned height;
+	};
+
+	std::vector<std::thread> workers;
+	std::deque<Job> jobs;
+	mutable std::mutex lock;
+	std::condition_variable work_cond;
+	std::condition_variable done_cond;
+	unsigned max_queued_frames;
+	unsigned active_jobs = 0;
+	bool failed = false;
+	bool dead = false;
+
+	void worker_loop();
+	static bool encode(const Job &job);
+};
+}
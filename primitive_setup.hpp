@@ -40,11 +40,20 @@ struct PrimitiveSetupAttr
 	int16_t v_offset;
 };
 
+// Inclusive pixel bounds of the primitive, derived from the span equations.
+// Computed once in setup so binning can reject tiles without re-evaluating edges.
+struct PrimitiveSetupBBox
+{
+	int16_t min_x, max_x, min_y, max_y;
+};
+
 struct PrimitiveSetup
 {
 	PrimitiveSetupPos pos;
 	PrimitiveSetupAttr attr;
+	PrimitiveSetupBBox bbox;
 };
 
-static_assert((sizeof(PrimitiveSetup) & 15) == 0, "PrimitiveSetup is not aligned to 16 bytes.");
+static_assert((sizeof(PrimitiveSetupPos) & 15) == 0, "PrimitiveSetupPos is not aligned to 16 bytes.");
+static_assert((sizeof(PrimitiveSetupAttr) & 15) == 0, "PrimitiveSetupAttr is not aligned to 16 bytes.");
 }
@@ -1,25 +1,105 @@
 #include <context.hpp>
 #include "rasterizer_gpu.hpp"
+#include "vram_allocator.hpp"
+#include "texture_quantizer.hpp"
 #include "context.hpp"
 #include "device.hpp"
 #include <stdexcept>
+#include <assert.h>
 #include "math.hpp"
 #include "stb_image_write.h"
+#include "hash.hpp"
 #include <string.h>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
 
 using namespace Granite;
 using namespace Vulkan;
 
 namespace RetroWarp
 {
-struct BBox
-{
-	int min_x, max_x, min_y, max_y;
-};
-
 constexpr unsigned MAX_NUM_SHADER_STATE_INDICES = 64;
 constexpr unsigned MAX_NUM_RENDER_STATE_INDICES = 1024;
 constexpr unsigned VRAM_SIZE = 64 * 1024 * 1024;
+constexpr unsigned MAX_NUM_STAGING_BUFFERS = 8;
+constexpr unsigned SUBMISSION_CHUNK_SIZE = 256;
+constexpr unsigned MIN_NUM_BATCHES_IN_FLIGHT = 2;
+constexpr unsigned MAX_NUM_BATCHES_IN_FLIGHT = 4;
+constexpr unsigned MIN_TILE_INSTANCE_CAPACITY = 0x1000;
+// Tile sizes adaptive tile size selection switches between.
+constexpr int SMALL_TILE_SIZE = 8;
+constexpr int LARGE_TILE_SIZE = 16;
+// A primitive with a WxW pixel bounding box covers about (W / 8 + 1)^2 small or (W / 16 + 1)^2 large tiles.
+// Switching up above 6 and down below 2 tile instances per primitive happens at roughly 11 and 7 pixels across,
+// the gap in between keeps the size from flipping back and forth.
+constexpr float LARGE_TILE_INSTANCES_PER_PRIMITIVE = 6.0f;
+constexpr float SMALL_TILE_INSTANCES_PER_PRIMITIVE = 2.0f;
+constexpr float ADAPTIVE_TILE_SIZE_RATE = 0.25f;
+constexpr VkDeviceSize TEXTURE_UPLOAD_ARENA_SIZE = 16 * 1024 * 1024;
+constexpr VkDeviceSize MIN_SETUP_BUFFER_SIZE = 64 * 1024;
+constexpr unsigned MAX_TEXTURE_LEVELS = 8;
+constexpr uint32_t TEXTURE_VRAM_ALIGNMENT = 64;
+constexpr unsigned NUM_SCANOUT_IMAGES = 3;
+constexpr unsigned NUM_READBACK_BUFFERS = 4;
+constexpr unsigned STATS_WINDOW_SIZE = 256;
+constexpr unsigned MAX_PENDING_TIMESTAMPS = 1024;
+// Upper bound of primitives clipping can produce from one triangle, see setup_clipped_triangles().
+constexpr unsigned MAX_CLIPPED_PRIMITIVES = 8;
+// Tile depth range as min | (max << 16) which bounds any depth.
+constexpr uint32_t HIZ_FULL_RANGE = 0xffff0000u;
+
+// Open-addressed hash table which maps state hashes to state indices within the current batch.
+// Entries are invalidated in bulk by bumping the generation, so resetting between batches is free.
+template <unsigned Size>
+struct BatchStateTable
+{
+	static_assert((Size & (Size - 1)) == 0, "Size must be power-of-two.");
+
+	struct Entry
+	{
+		Util::Hash hash;
+		uint32_t generation;
+		uint32_t index;
+	};
+	Entry entries[Size] = {};
+	uint32_t generation = 1;
+
+	void reset()
+	{
+		generation++;
+	}
+
+	// Returns index of an equivalent state, or -1 if the state is not part of the batch.
+	template <typename EqualFunc>
+	int find(Util::Hash hash, const EqualFunc &equal) const
+	{
+		for (uint32_t slot = uint32_t(hash) & (Size - 1);; slot = (slot + 1) & (Size - 1))
+		{
+			auto &entry = entries[slot];
+			if (entry.generation != generation)
+				return -1;
+			else if (entry.hash == hash && equal(entry.index))
+				return int(entry.index);
+		}
+	}
+
+	// Table must be sized so that it never fills up completely.
+	void insert(Util::Hash hash, uint32_t index)
+	{
+		for (uint32_t slot = uint32_t(hash) & (Size - 1);; slot = (slot + 1) & (Size - 1))
+		{
+			auto &entry = entries[slot];
+			if (entry.generation != generation)
+			{
+				entry = { hash, generation, index };
+				return;
+			}
+		}
+	}
+};
 
 struct RasterizerGPU::Impl
 {
@@ -32,13 +112,124 @@ struct RasterizerGPU::Impl
 		uint32_t width = 0;
 		uint32_t height = 0;
 		uint32_t stride = 0;
+		uint32_t clear_value = 0;
 	};
 
 	Framebuffer color, depth;
 
+	// Clears only mark tiles as cleared. ROP substitutes the clear value when it touches a tile,
+	// and remaining tiles are resolved before VRAM is observed outside the rasterizer.
+	struct
+	{
+		BufferHandle color;
+		BufferHandle depth;
+		unsigned num_pending_rows = 0;
+	} fast_clear;
+
+	// Per-tile depth range written by ROP for the tiles it touches, which binning culls occluded primitives against.
+	// Untouched tiles keep their range, which is reset for every tile whenever depth changes outside of ROP.
+	// Binning only waits for the ROP pass which last used its batch slot, so the range it reads may be
+	// from that pass or any later one. That range only bounds the depth ROP tests against if depth cannot
+	// have moved the other way since, so changes are tracked per direction by flush index.
+	struct
+	{
+		BufferHandle ranges;
+		// Number of split flushes so far, i.e. the index of the next one.
+		uint64_t flush_index = 0;
+		// First flush whose ROP observes the most recent change which may decrease or increase depth.
+		uint64_t last_decrease = 0;
+		uint64_t last_increase = 0;
+		uint32_t cull_mode = 0;
+	} hiz;
+
+	struct TextureUpload
+	{
+		VkDeviceSize arena_offset;
+		VkDeviceSize size;
+		uint32_t vram_offset;
+		uint32_t blocks_width;
+		uint32_t blocks_height;
+		uint32_t width;
+		uint32_t height;
+		TextureFormatBits fmt;
+	};
+
+	// Host-visible arena which queued uploads are copied into.
+	// It is reused once the fence of the previous submission signals, and only grows for oversized uploads.
+	struct
+	{
+		BufferHandle arena;
+		uint8_t *mapped = nullptr;
+		VkDeviceSize offset = 0;
+		Fence fence;
+		std::vector<TextureUpload> uploads;
+	} texture_upload;
+
+	// Persistent images the color framebuffer is copied into for presentation, recycled as a ring.
+	struct
+	{
+		ImageHandle images[NUM_SCANOUT_IMAGES];
+		unsigned index = 0;
+	} scanout_ring;
+
+	// Ring of host buffers for asynchronous readback of the color framebuffer.
+	// Slots complete in submission order.
+	struct ReadbackSlot
+	{
+		BufferHandle buffer;
+		Fence fence;
+		unsigned width = 0;
+		unsigned height = 0;
+		RasterizerGPU::ReadbackCallback callback;
+	};
+
+	struct
+	{
+		ReadbackSlot slots[NUM_READBACK_BUFFERS];
+		unsigned index = 0;
+	} readback;
+
+	struct TextureResource
+	{
+		TextureDescriptor desc;
+		TextureFormatBits fmt;
+		// Paletted formats hold indices in the red channel of data, VQ holds the index map of each level.
+		std::vector<uint32_t> data;
+		// CLUT, or codebook of 2x2 blocks.
+		std::vector<uint32_t> palette;
+		struct
+		{
+			size_t data_offset;
+			unsigned width;
+			unsigned height;
+			uint32_t vram_offset;
+		} levels[MAX_TEXTURE_LEVELS];
+		unsigned num_levels;
+		uint32_t vram_size;
+		bool resident;
+		uint64_t last_used_frame;
+		// The open batch may sample the texture even after next_frame().
+		uint64_t last_used_batch;
+	};
+	std::vector<TextureResource> textures;
+	VRAMAllocator vram_allocator;
+	uint64_t frame_index = 0;
+
+	bool allocate_vram(uint32_t size, uint32_t alignment, uint32_t &offset);
+	bool evict_texture();
+	bool make_texture_resident(TextureResource &texture);
+	void queue_palette_upload(uint32_t offset, const uint32_t *palette, unsigned num_colors);
+	void queue_quantized_texture_upload(uint32_t offset, uint32_t palette_offset, const uint32_t *src,
+	                                    unsigned width, unsigned height, TextureFormatBits fmt);
+
 	bool subgroup = false;
 	bool ubershader = false;
 	bool async_compute = false;
+	// Batches which only use replace blending without alpha test are shaded after depth is resolved.
+	bool deferred_shading = false;
+	// Set once VRAM was accessed on the generic queue since the last texture upload, by ROP, clear resolves
+	// or scanout.
+	bool generic_since_upload = false;
 
 	struct
 	{
@@ -46,25 +237,38 @@ struct RasterizerGPU::Impl
 		BufferHandle mask_buffer_low_res;
 
 		// Bin at 16x16.
-		BufferHandle mask_buffer[2];
+		BufferHandle mask_buffer[MAX_NUM_BATCHES_IN_FLIGHT];
 
 		// Groups group of 32 primitives into one 1 bit for faster rejection in raster.
-		BufferHandle mask_buffer_coarse[2];
+		BufferHandle mask_buffer_coarse[MAX_NUM_BATCHES_IN_FLIGHT];
+
+		// Split path only. Binning appends every tile it bins a primitive to into the slot's list,
+		// which starts with the indirect dispatch arguments for ROP.
+		// A tile is appended by the first workgroup which stamps it with the batch's stamp.
+		BufferHandle touched_tile_stamps;
+		BufferHandle touched_tiles[MAX_NUM_BATCHES_IN_FLIGHT];
+		uint32_t touched_tile_stamp = 0;
 	} binning;
 
 	struct
 	{
 		// Final resolved tile offsets.
-		BufferHandle tile_offset[2];
+		BufferHandle tile_offset[MAX_NUM_BATCHES_IN_FLIGHT];
 	} tile_count;
 
+	// Per-slot buffers are allocated on first use of a slot.
+	// Tile instance storage grows with the largest batch seen in that slot.
 	struct
 	{
-		BufferHandle color[2];
-		BufferHandle depth[2];
-		BufferHandle flags[2];
+		BufferHandle color[MAX_NUM_BATCHES_IN_FLIGHT];
+		BufferHandle depth[MAX_NUM_BATCHES_IN_FLIGHT];
+		BufferHandle flags[MAX_NUM_BATCHES_IN_FLIGHT];
+		unsigned capacity[MAX_NUM_BATCHES_IN_FLIGHT] = {};
+		// Tile size the capacity is counted in.
+		int tile_size[MAX_NUM_BATCHES_IN_FLIGHT] = {};
 		unsigned index = 0;
-		Semaphore rop_complete[2];
+		unsigned num_slots = 0;
+		Semaphore rop_complete[MAX_NUM_BATCHES_IN_FLIGHT];
 	} tile_instance_data;
 
 	struct RenderState
@@ -82,20 +286,49 @@ struct RasterizerGPU::Impl
 	};
 	static_assert(sizeof(RenderState) == 64, "Sizeof render state must be 64.");
 
+	struct StagingRegion
+	{
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+	};
+
+	// All per-batch data lives in one buffer, sub-allocated with these regions.
+	struct
+	{
+		StagingRegion positions;
+		StagingRegion attributes;
+		StagingRegion bboxes;
+		StagingRegion shader_state_index;
+		StagingRegion render_state_index;
+		StagingRegion render_state;
+		VkDeviceSize size = 0;
+	} staging_layout;
+
+	struct StagingBuffer
+	{
+		BufferHandle gpu;
+		// Same as gpu if device memory can be mapped directly.
+		BufferHandle host;
+		// Indices, CPU vertices and vertex transforms for GPU triangle setup, and the vertices it reads when
+		// vertices are transformed on the GPU. Grow geometrically and are recycled along with the rest of
+		// the entry, so steady state batches allocate nothing.
+		BufferHandle setup_input;
+		BufferHandle setup_vertices;
+		// Signalled when the last batch which used this buffer has completed.
+		Fence fence;
+	};
+
+	// Persistent ring of staging buffers, recycled as their fences signal.
+	std::vector<StagingBuffer> staging_ring;
+	unsigned staging_ring_index = 0;
+
 	struct
 	{
-		BufferHandle positions;
-		BufferHandle attributes;
-		BufferHandle shader_state_index;
-		BufferHandle render_state_index;
-		BufferHandle render_state;
-		BufferHandle positions_gpu;
-		BufferHandle attributes_gpu;
-		BufferHandle shader_state_index_gpu;
-		BufferHandle render_state_index_gpu;
-		BufferHandle render_state_gpu;
+		BufferHandle host;
+		BufferHandle gpu;
 		PrimitiveSetupPos *mapped_positions = nullptr;
 		PrimitiveSetupAttr *mapped_attributes = nullptr;
+		PrimitiveSetupBBox *mapped_bboxes = nullptr;
 		uint8_t *mapped_shader_state_index = nullptr;
 		uint16_t *mapped_render_state_index = nullptr;
 		RenderState *mapped_render_state = nullptr;
@@ -107,7 +340,12 @@ struct RasterizerGPU::Impl
 	struct
 	{
 		BufferHandle item_count_per_variant;
-		BufferHandle work_list_per_variant;
+		// Work items in tile instance order as emitted by binning, and compacted so each variant's
+		// work is contiguous. Both follow the largest tile instance buffer.
+		BufferHandle work_list_unsorted;
+		BufferHandle work_list;
+		BufferHandle work_list_offsets;
+		unsigned work_list_capacity = 0;
 	} raster_work;
 
 	struct
@@ -115,50 +353,284 @@ struct RasterizerGPU::Impl
 		uint32_t shader_states[MAX_NUM_SHADER_STATE_INDICES] = {};
 		unsigned shader_state_count = 0;
 		uint32_t current_shader_state = 0;
+		BatchStateTable<2 * MAX_NUM_SHADER_STATE_INDICES> shader_state_table;
 
-		RenderState last_render_state;
+		// CPU copy of the render states in the batch, staging memory might be uncached.
+		RenderState render_states[MAX_NUM_RENDER_STATE_INDICES];
 		RenderState current_render_state;
+		unsigned last_render_state_index = 0;
 		unsigned render_state_count = 0;
+		BatchStateTable<2 * MAX_NUM_RENDER_STATE_INDICES> render_state_table;
+
+		// Incremented for every batch.
+		uint64_t batch_id = 0;
+
+		// DEPTH_CHANGE_* bits for the render states in the batch.
+		uint32_t depth_changes = 0;
+		// Set if any render state in the batch blends or alpha tests, which deferred shading cannot do.
+		bool needs_forward_shading = false;
+		// Decided when the batch is closed, see end_staging().
+		bool deferred = false;
+		bool ubershader_rop = false;
 	} state;
 
-	void init(Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size);
+	struct StateBlock
+	{
+		RenderState render_state;
+		uint32_t shader_state;
+		Util::Hash render_state_hash;
+		Util::Hash shader_state_hash;
+
+		// State indices are cached for the batch they were last bound in.
+		uint64_t batch_id;
+		uint8_t shader_state_index;
+		uint16_t render_state_index;
+	};
+	std::vector<StateBlock> state_blocks;
+
+	// A batch captured by command list recording. The buffer has the same layout as a staging buffer.
+	struct RecordedBatch
+	{
+		BufferHandle buffer;
+		unsigned count;
+		unsigned num_conservative_tile_instances;
+		unsigned render_state_count;
+		uint32_t depth_changes;
+		bool deferred;
+		bool ubershader_rop;
+		int tile_size;
+		std::vector<uint32_t> shader_states;
+	};
+
+	struct RecordedCommandList
+	{
+		std::vector<RecordedBatch> batches;
+	};
+	std::vector<RecordedCommandList> command_lists;
+	std::vector<uint32_t> free_command_lists;
+	// Batches are captured into this list rather than rendered while recording.
+	uint32_t recording_list = ~0u;
+
+	void record_batch();
+	void execute_command_list(const RecordedCommandList &list);
+
+	// Triangles queued with rasterize_triangles() are clipped and set up by triangle_setup.comp when
+	// the batch is flushed. Each triangle owns MAX_CLIPPED_PRIMITIVES consecutive primitive slots.
+	struct TriangleSetupJob
+	{
+		// Transformed vertices are placed after the vertices uploaded from the CPU.
+		bool transformed;
+		uint32_t vertex_offset;
+		uint32_t index_offset;
+		uint32_t num_triangles;
+		uint32_t primitive_offset;
+		CullMode cull_mode;
+		ViewportTransform viewport;
+		int scissor[4];
+	};
+
+	// Matches VertexTransform in vertex_transform.comp, std430 layout.
+	struct VertexTransformGPU
+	{
+		float mvp[16];
+		float normal_matrix[12];
+		float light_direction[4];
+		float diffuse;
+		float ambient;
+		float padding[2];
+	};
+
+	struct VertexTransformJob
+	{
+		BufferHandle vertices;
+		uint32_t num_vertices;
+		uint32_t transform_index;
+		uint32_t output_offset;
+	};
+
+	// Where the vertices of a rasterize_triangles() call come from.
+	// Either CPU vertices, or a static vertex buffer which is transformed on the GPU.
+	struct TriangleVertexSource
+	{
+		const Vertex *vertices;
+		unsigned num_vertices;
+		uint32_t vertex_buffer;
+		const VertexTransform *transform;
+	};
+
+	struct
+	{
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+		std::vector<TriangleSetupJob> jobs;
+		std::vector<VertexTransformGPU> transforms;
+		std::vector<VertexTransformJob> transform_jobs;
+		uint32_t num_transformed_vertices = 0;
+	} triangle_setup;
+
+	std::vector<BufferHandle> static_vertex_buffers;
+	std::vector<uint32_t> free_static_vertex_buffers;
+
+	void queue_triangles(const TriangleVertexSource &source, const uint32_t *indices,
+	                     unsigned num_triangles, CullMode mode, const ViewportTransform &vp);
+	uint32_t queue_triangle_vertices(const TriangleVertexSource &source);
+	void run_vertex_transform(CommandBuffer &cmd, const Buffer &vertex_buffer,
+	                          const Buffer &transform_buffer, VkDeviceSize transform_offset);
+	void run_triangle_setup(CommandBuffer &cmd);
+	void read_back_staged_setup(std::vector<PrimitiveSetup> &setups);
+	void grow_setup_buffer(BufferHandle &buffer, BufferDomain domain, VkBufferUsageFlags usage, VkDeviceSize size);
+	std::unordered_map<Util::Hash, uint32_t> state_block_lookup;
+
+	// Block submission may happen from multiple threads. The lock guards batch bookkeeping
+	// (staging cursor, state tables, state blocks). Primitive data is written outside the lock
+	// into reserved ranges, and a batch is only flushed once all writers into it have completed.
+	std::mutex submission_lock;
+	std::condition_variable submission_idle;
+	unsigned active_writers = 0;
+
+	// Rolling window of samples, oldest samples are overwritten first.
+	struct StatsWindow
+	{
+		std::vector<double> samples;
+		unsigned next = 0;
+	};
+
+	struct PendingTimestamps
+	{
+		QueryPoolHandle start;
+		QueryPoolHandle end;
+		RasterizerStage stage;
+	};
+
+	// Guarded by its own lock, as stats may be queried from a monitoring thread while flushing.
+	struct
+	{
+		std::mutex lock;
+		std::vector<PendingTimestamps> pending;
+		StatsWindow stage_times[unsigned(RasterizerStage::Count)];
+		StatsWindow primitives;
+		StatsWindow tile_instances;
+		StatsWindow shader_variants;
+		uint64_t num_flushes = 0;
+		uint64_t num_primitives = 0;
+		uint64_t num_tile_instances = 0;
+	} stats;
+
+	void register_stage_time(const QueryPoolHandle &start, const QueryPoolHandle &end,
+	                         RasterizerStage stage, const char *tag);
+	void record_flush_stats();
+	void resolve_pending_timestamps();
+	static void add_sample(StatsWindow &window, double value);
+	static RasterizerDistribution summarize(const StatsWindow &window);
+
+	struct PrimitiveReservation
+	{
+		unsigned offset;
+		unsigned count;
+		uint8_t shader_state_index;
+		uint16_t render_state_index;
+	};
+
+	void init(Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size,
+	          unsigned max_primitives, unsigned num_batches_in_flight);
 
 	void reset_staging();
 	void begin_staging();
 	void end_staging();
+	void init_staging_layout();
+	StagingBuffer create_staging_buffer();
+	StagingBuffer &acquire_staging_buffer();
+	void set_staging_storage_buffer(CommandBuffer &cmd, unsigned binding, const StagingRegion &region) const;
+	void set_staging_uniform_buffer(CommandBuffer &cmd, unsigned binding, const StagingRegion &region) const;
 
 	void init_binning_buffers();
-	void init_prefix_sum_buffers();
-	void init_tile_buffers();
+	void init_low_res_mask_buffer();
 	void init_raster_work_buffers();
+	void init_fast_clear_buffers();
+	void queue_texture_upload(uint32_t offset, const uint32_t *src, unsigned width, unsigned height,
+	                          TextureFormatBits fmt);
+	Fence submit_texture_uploads();
+	void fast_clear_framebuffer(const Buffer &metadata, const Framebuffer &fb, const char *tag);
+	void resolve_fast_clears();
+	void init_hiz_buffer();
+	void invalidate_hiz(uint32_t range = HIZ_FULL_RANGE);
+	void update_hiz_cull_mode();
+	void prepare_batch_slot(unsigned slot);
+	void advance_batch_slot();
 	void flush();
-	void flush_ubershader();
-	void flush_split();
+	// Closes the open batch, if any. Queued uploads are only submitted when a batch depends on them.
+	void flush_primitives();
+	void submit_batch(Fence *fence);
+	void flush_ubershader(Fence *fence, bool deferred);
+	void flush_split(Fence *fence);
 	ImageHandle copy_to_framebuffer();
+	void scanout(const RenderPassInfo &rp);
+	void record_framebuffer_readback(CommandBuffer &cmd, const Buffer &dst);
+	void read_canvas_async(RasterizerGPU::ReadbackCallback callback);
+	void complete_readback(ReadbackSlot &slot);
+	void poll_readbacks(bool wait);
 
 	void queue_primitive(const PrimitiveSetup &setup);
-	unsigned compute_num_conservative_tiles(const PrimitiveSetup &setup) const;
-
-	BBox compute_bbox(const PrimitiveSetup &setup) const;
-	bool clip_bbox_scissor(BBox &clipped_bbox, const BBox &bbox) const;
+	void queue_primitives(uint32_t block_index, const PrimitiveSetup *setup, size_t count);
+	bool reserve_primitives(PrimitiveReservation &reservation, StateBlock &block,
+	                        const unsigned *num_conservative_tiles, unsigned count);
+	bool bind_state_block(StateBlock &block);
+	RenderStateBlock create_render_state_block();
+	int find_shader_state(uint32_t shader_state, Util::Hash hash) const;
+	int find_render_state(const RenderState &render_state, Util::Hash hash) const;
+	unsigned insert_shader_state(uint32_t shader_state, Util::Hash hash);
+	unsigned insert_render_state(const RenderState &render_state, Util::Hash hash);
+	static Util::Hash hash_shader_state(uint32_t shader_state);
+	static Util::Hash hash_render_state(const RenderState &render_state);
+	unsigned compute_num_conservative_tiles(const PrimitiveSetupBBox &clipped_bbox) const;
+	static bool clip_bbox_scissor(PrimitiveSetupBBox &clipped_bbox, const PrimitiveSetupBBox &bbox,
+	                              const RenderState &render_state);
 
 	void set_fb_info(CommandBuffer &cmd);
 	void clear_indirect_buffer(CommandBuffer &cmd);
 	void binning_low_res_prepass(CommandBuffer &cmd);
 	void binning_full_res(CommandBuffer &cmd, bool ubershader);
+	void compact_work_list(CommandBuffer &cmd);
 	void dispatch_combiner_work(CommandBuffer &cmd);
 	void run_rop(CommandBuffer &cmd);
 	void run_rop_ubershader(CommandBuffer &cmd);
+	void run_rop_deferred(CommandBuffer &cmd);
 
 	bool can_support_minimum_subgroup_size(unsigned size) const;
 	bool supports_subgroup_size_control(uint32_t minimum_size, uint32_t maximum_size) const;
 
 	int tile_size = 0;
 	int tile_size_log2 = 0;
+	// Tile grid of the current tile size. Follows the configured framebuffers.
 	int max_tiles_x = 0;
 	int max_tiles_y = 0;
 	int max_tiles_x_low_res = 0;
 	int max_tiles_y_low_res = 0;
+	// Number of tiles per-tile buffers are sized for, which covers the grid of every tile size in use.
+	unsigned tile_grid_capacity = 0;
+	unsigned tile_grid_capacity_low_res = 0;
+	void resize_tile_grid();
+
+	// Picks the tile size per flush from how many tile instances primitives of recent batches cover.
+	// Large primitives spend binning and work list traffic on many small tiles,
+	// small primitives shade mostly empty pixels in large tiles.
+	struct
+	{
+		bool enable = false;
+		// Tile size passed to init(), used while not adapting.
+		int fixed_tile_size = 0;
+		// Moving average of conservative tile instances per primitive at the current tile size, negative until sampled.
+		float instances_per_primitive = -1.0f;
+	} adaptive_tile_size;
+	int select_tile_size();
+	void set_tile_size(int size);
+
+	// Batch capacity, fixed at init. The binning bitmask strides and tile instance budget follow from it.
+	// The budget is raised to the tile grid so a single primitive always fits in an empty batch.
+	unsigned max_primitives = 0;
+	unsigned tile_binning_stride = 0;
+	unsigned tile_binning_stride_coarse = 0;
+	unsigned max_tile_instances = 0;
 
 	uint32_t compute_shader_state() const;
 };
@@ -180,17 +652,65 @@ struct FBInfo
 	uint32_t depth_width;
 	uint32_t depth_height;
 	uint32_t depth_stride;
+
+	uint32_t tile_binning_stride;
+	uint32_t tile_binning_stride_coarse;
+
+	uint32_t color_clear_value;
+	uint32_t depth_clear_value;
+
+	uint32_t tile_grid_stride;
+	uint32_t tile_grid_stride_low_res;
+
+	uint32_t hiz_cull_mode;
+	uint32_t touched_tile_stamp;
+};
+
+// Matches HIZ_CULL_* in fb_info.h.
+enum HiZCullBits
+{
+	HIZ_CULL_LESS_BIT = 1,
+	HIZ_CULL_GREATER_BIT = 2
 };
 
-constexpr int MAX_PRIMITIVES = 0x4000;
-constexpr int TILE_BINNING_STRIDE = MAX_PRIMITIVES / 32;
-constexpr int TILE_BINNING_STRIDE_COARSE = TILE_BINNING_STRIDE / 32;
+// Directions in which a render state may move the depth buffer.
+enum DepthChangeBits
+{
+	DEPTH_CHANGE_DECREASE_BIT = 1,
+	DEPTH_CHANGE_INCREASE_BIT = 2
+};
+
+static uint32_t compute_depth_changes(uint8_t depth_state)
+{
+	if ((depth_state & uint8_t(DepthWrite::On)) == 0)
+		return 0;
+
+	switch (DepthTest(depth_state & 7))
+	{
+	case DepthTest::LE:
+	case DepthTest::LEQ:
+		return DEPTH_CHANGE_DECREASE_BIT;
+
+	case DepthTest::GE:
+	case DepthTest::GEQ:
+		return DEPTH_CHANGE_INCREASE_BIT;
+
+	case DepthTest::EQ:
+	case DepthTest::Never:
+		return 0;
+
+	default:
+		return DEPTH_CHANGE_DECREASE_BIT | DEPTH_CHANGE_INCREASE_BIT;
+	}
+}
+
+constexpr unsigned MIN_MAX_PRIMITIVES = 0x400;
+constexpr unsigned MAX_MAX_PRIMITIVES = 0x40000;
+constexpr unsigned TILE_INSTANCES_PER_PRIMITIVE = 4;
 constexpr int MAX_WIDTH = 2048;
 constexpr int MAX_HEIGHT = 2048;
 constexpr int TILE_DOWNSAMPLE = 8;
 constexpr int TILE_DOWNSAMPLE_LOG2 = 3;
-constexpr int MAX_NUM_TILE_INSTANCES = 0xffff;
-const int RASTER_ROUNDING = (1 << (SUBPIXELS_LOG2 + 16)) - 1;
 
 struct TileRasterWork
 {
@@ -199,81 +719,170 @@ struct TileRasterWork
 	uint32_t primitive;
 };
 
+// Textures are stored in VRAM as 128 byte blocks, covering 8x8 texels, 16x8 texels for 8-bit formats
+// or 32x8 texels for 4-bit formats. VQ blocks hold 16x8 indices, covering 32x16 texels.
+static bool compute_texture_blocks(TextureFormatBits fmt, unsigned width, unsigned height,
+                                   uint32_t &blocks_width, uint32_t &blocks_height)
+{
+	switch (fmt)
+	{
+	case TEXTURE_FMT_VQ:
+		blocks_width = (width + 31) / 32;
+		blocks_height = (height + 15) / 16;
+		return true;
+
+	case TEXTURE_FMT_ARGB1555:
+	case TEXTURE_FMT_LA88:
+		blocks_width = (width + 7) / 8;
+		break;
+
+	case TEXTURE_FMT_I8:
+	case TEXTURE_FMT_PAL8:
+		blocks_width = (width + 15) / 16;
+		break;
+
+	case TEXTURE_FMT_PAL4:
+		blocks_width = (width + 31) / 32;
+		break;
+
+	default:
+		return false;
+	}
+
+	blocks_height = (height + 7) / 8;
+	return true;
+}
+
+// Number of CLUT or codebook texels, or 0 for formats without either.
+static unsigned get_palette_size(TextureFormatBits fmt)
+{
+	switch (fmt)
+	{
+	case TEXTURE_FMT_PAL4:
+		return 16;
+	case TEXTURE_FMT_PAL8:
+		return 256;
+	case TEXTURE_FMT_VQ:
+		return VectorQuantizer::CODEBOOK_SIZE * VectorQuantizer::BLOCK_TEXELS;
+	default:
+		return 0;
+	}
+}
+
+// CLUTs and codebooks are uploaded as ARGB1555 textures, which write whole 128 byte blocks.
+static uint32_t get_palette_vram_size(TextureFormatBits fmt)
+{
+	return ((get_palette_size(fmt) + 63) / 64) * 64 * sizeof(uint16_t);
+}
+
 void RasterizerGPU::Impl::reset_staging()
 {
 	staging = {};
+	triangle_setup.vertices.clear();
+	triangle_setup.indices.clear();
+	triangle_setup.jobs.clear();
+	triangle_setup.transforms.clear();
+	triangle_setup.transform_jobs.clear();
+	triangle_setup.num_transformed_vertices = 0;
 	state.render_state_count = 0;
+	state.depth_changes = 0;
+	state.needs_forward_shading = false;
+	state.deferred = false;
+	state.ubershader_rop = false;
 	state.shader_state_count = 0;
+	state.render_state_table.reset();
+	state.shader_state_table.reset();
+	state.batch_id++;
 }
 
-uint32_t RasterizerGPU::Impl::compute_shader_state() const
+Util::Hash RasterizerGPU::Impl::hash_shader_state(uint32_t shader_state)
 {
-	// Ignore shader state for ubershaders.
-	if (ubershader)
-		return 0;
-
-	uint32_t shader_state = 0;
-	shader_state |= state.current_render_state.combiner_state;
-	shader_state |= state.current_render_state.alpha_threshold << 8u;
-	shader_state |= state.current_render_state.tex.texture_fmt << 16u;
-	return shader_state;
+	Util::Hasher h;
+	h.u32(shader_state);
+	return h.get();
 }
 
-BBox RasterizerGPU::Impl::compute_bbox(const PrimitiveSetup &setup) const
+Util::Hash RasterizerGPU::Impl::hash_render_state(const RenderState &render_state)
 {
-	int lo_x = std::numeric_limits<int>::max();
-	int hi_x = std::numeric_limits<int>::min();
-	int lo_y = std::numeric_limits<int>::max();
-	int hi_y = std::numeric_limits<int>::min();
+	uint32_t words[sizeof(RenderState) / sizeof(uint32_t)];
+	memcpy(words, &render_state, sizeof(RenderState));
 
-	lo_x = std::min(lo_x, setup.pos.x_a);
-	lo_x = std::min(lo_x, setup.pos.x_b);
-	lo_x = std::min(lo_x, setup.pos.x_c);
-	hi_x = std::max(hi_x, setup.pos.x_a);
-	hi_x = std::max(hi_x, setup.pos.x_b);
-	hi_x = std::max(hi_x, setup.pos.x_c);
+	Util::Hasher h;
+	for (auto &word : words)
+		h.u32(word);
+	return h.get();
+}
 
-	int end_point_a = setup.pos.x_a + setup.pos.dxdy_a * (setup.pos.y_hi - setup.pos.y_lo);
-	int end_point_b = setup.pos.x_b + setup.pos.dxdy_b * (setup.pos.y_mid - setup.pos.y_lo);
-	int end_point_c = setup.pos.x_c + setup.pos.dxdy_c * (setup.pos.y_hi - setup.pos.y_mid);
+int RasterizerGPU::Impl::find_shader_state(uint32_t shader_state, Util::Hash hash) const
+{
+	return state.shader_state_table.find(hash, [&](uint32_t index) {
+		return state.shader_states[index] == shader_state;
+	});
+}
 
-	lo_x = std::min(lo_x, end_point_a);
-	lo_x = std::min(lo_x, end_point_b);
-	lo_x = std::min(lo_x, end_point_c);
-	hi_x = std::max(hi_x, end_point_a);
-	hi_x = std::max(hi_x, end_point_b);
-	hi_x = std::max(hi_x, end_point_c);
+int RasterizerGPU::Impl::find_render_state(const RenderState &render_state, Util::Hash hash) const
+{
+	return state.render_state_table.find(hash, [&](uint32_t index) {
+		return memcmp(&render_state, &state.render_states[index], sizeof(RenderState)) == 0;
+	});
+}
 
-	BBox bbox = {};
-	bbox.min_x = (lo_x + RASTER_ROUNDING) >> (16 + SUBPIXELS_LOG2);
-	bbox.max_x = (hi_x - 1) >> (16 + SUBPIXELS_LOG2);
-	bbox.min_y = (setup.pos.y_lo + (1 << SUBPIXELS_LOG2) - 1) >> SUBPIXELS_LOG2;
-	bbox.max_y = (setup.pos.y_hi - 1) >> SUBPIXELS_LOG2;
-	return bbox;
+unsigned RasterizerGPU::Impl::insert_shader_state(uint32_t shader_state, Util::Hash hash)
+{
+	unsigned index = state.shader_state_count++;
+	state.shader_states[index] = shader_state;
+	state.shader_state_table.insert(hash, index);
+	return index;
 }
 
-bool RasterizerGPU::Impl::clip_bbox_scissor(BBox &clipped_bbox, const BBox &bbox) const
+unsigned RasterizerGPU::Impl::insert_render_state(const RenderState &render_state, Util::Hash hash)
 {
-	int scissor_x = state.current_render_state.scissor_x;
-	int scissor_y = state.current_render_state.scissor_y;
-	int scissor_width = state.current_render_state.scissor_width;
-	int scissor_height = state.current_render_state.scissor_height;
+	unsigned index = state.render_state_count++;
+	state.render_states[index] = render_state;
+	state.depth_changes |= compute_depth_changes(render_state.depth_state);
+	if (render_state.blend_state != uint8_t(BlendState::Replace) || render_state.alpha_threshold != 0)
+		state.needs_forward_shading = true;
+	staging.mapped_render_state[index] = render_state;
+	state.render_state_table.insert(hash, index);
+	return index;
+}
 
-	clipped_bbox.min_x = std::max(scissor_x, bbox.min_x);
-	clipped_bbox.max_x = std::min(scissor_x + scissor_width - 1, bbox.max_x);
-	clipped_bbox.min_y = std::max(scissor_y, bbox.min_y);
-	clipped_bbox.max_y = std::min(scissor_y + scissor_height - 1, bbox.max_y);
+uint32_t RasterizerGPU::Impl::compute_shader_state() const
+{
+	// Ignore shader state for ubershaders.
+	if (ubershader)
+		return 0;
 
-	return clipped_bbox.min_x <= clipped_bbox.max_x && clipped_bbox.min_y <= clipped_bbox.max_y;
+	uint32_t shader_state = 0;
+	shader_state |= state.current_render_state.combiner_state;
+	shader_state |= state.current_render_state.alpha_threshold << 8u;
+	shader_state |= state.current_render_state.tex.texture_fmt << 16u;
+	return shader_state;
 }
 
-unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const PrimitiveSetup &setup) const
+bool RasterizerGPU::Impl::clip_bbox_scissor(PrimitiveSetupBBox &clipped_bbox, const PrimitiveSetupBBox &bbox,
+                                            const RenderState &render_state)
 {
-	auto bbox = compute_bbox(setup);
-	BBox clipped_bbox;
-	if (!clip_bbox_scissor(clipped_bbox, bbox))
-		return 0;
+	int scissor_x = render_state.scissor_x;
+	int scissor_y = render_state.scissor_y;
+	int scissor_width = render_state.scissor_width;
+	int scissor_height = render_state.scissor_height;
+
+	int min_x = std::max<int>(scissor_x, bbox.min_x);
+	int max_x = std::min<int>(scissor_x + scissor_width - 1, bbox.max_x);
+	int min_y = std::max<int>(scissor_y, bbox.min_y);
+	int max_y = std::min<int>(scissor_y + scissor_height - 1, bbox.max_y);
+
+	clipped_bbox.min_x = int16_t(min_x);
+	clipped_bbox.max_x = int16_t(max_x);
+	clipped_bbox.min_y = int16_t(min_y);
+	clipped_bbox.max_y = int16_t(max_y);
+
+	return min_x <= max_x && min_y <= max_y;
+}
 
+unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const PrimitiveSetupBBox &clipped_bbox) const
+{
 	int start_tile_x = clipped_bbox.min_x >> tile_size_log2;
 	int end_tile_x = clipped_bbox.max_x >> tile_size_log2;
 	int start_tile_y = clipped_bbox.min_y >> tile_size_log2;
@@ -281,91 +890,107 @@ unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const PrimitiveSetu
 	return (end_tile_x - start_tile_x + 1) * (end_tile_y - start_tile_y + 1);
 }
 
-void RasterizerGPU::Impl::begin_staging()
+void RasterizerGPU::Impl::init_staging_layout()
+{
+	auto &limits = device->get_gpu_properties().limits;
+	VkDeviceSize alignment = std::max<VkDeviceSize>(limits.minStorageBufferOffsetAlignment,
+	                                                limits.minUniformBufferOffsetAlignment);
+	alignment = std::max<VkDeviceSize>(alignment, 16);
+
+	VkDeviceSize offset = 0;
+	const auto allocate_region = [&](StagingRegion &region, VkDeviceSize size) {
+		region.offset = offset;
+		region.size = size;
+		offset = (offset + size + alignment - 1) & ~(alignment - 1);
+	};
+
+	allocate_region(staging_layout.positions, max_primitives * sizeof(PrimitiveSetupPos));
+	allocate_region(staging_layout.attributes, max_primitives * sizeof(PrimitiveSetupAttr));
+	allocate_region(staging_layout.bboxes, max_primitives * sizeof(PrimitiveSetupBBox));
+	allocate_region(staging_layout.shader_state_index, max_primitives * sizeof(uint8_t));
+	allocate_region(staging_layout.render_state_index, max_primitives * sizeof(uint16_t));
+	allocate_region(staging_layout.render_state, MAX_NUM_RENDER_STATE_INDICES * sizeof(RenderState));
+	staging_layout.size = offset;
+}
+
+RasterizerGPU::Impl::StagingBuffer RasterizerGPU::Impl::create_staging_buffer()
 {
+	StagingBuffer buffer;
+
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
+	info.size = staging_layout.size;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+	             VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	buffer.gpu = device->create_buffer(info);
 
-	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-	info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupPos);
-	staging.positions_gpu = device->create_buffer(info);
-	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-	info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupAttr);
-	staging.attributes_gpu = device->create_buffer(info);
-	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-	info.size = MAX_PRIMITIVES * sizeof(uint8_t);
-	staging.shader_state_index_gpu = device->create_buffer(info);
-	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-	info.size = MAX_PRIMITIVES * sizeof(uint16_t);
-	staging.render_state_index_gpu = device->create_buffer(info);
-	info.size = MAX_NUM_RENDER_STATE_INDICES * sizeof(RenderState);
-	staging.render_state_gpu = device->create_buffer(info);
-
-	staging.mapped_positions = static_cast<PrimitiveSetupPos *>(
-			device->map_host_buffer(*staging.positions_gpu,
-			                       MEMORY_ACCESS_WRITE_BIT));
-	staging.mapped_attributes = static_cast<PrimitiveSetupAttr *>(
-			device->map_host_buffer(*staging.attributes_gpu,
-			                       MEMORY_ACCESS_WRITE_BIT));
-	staging.mapped_shader_state_index = static_cast<uint8_t *>(
-			device->map_host_buffer(*staging.shader_state_index_gpu,
-			                        MEMORY_ACCESS_WRITE_BIT));
-	staging.mapped_render_state = static_cast<RenderState *>(
-			device->map_host_buffer(*staging.render_state_gpu,
-			                        MEMORY_ACCESS_WRITE_BIT));
-	staging.mapped_render_state_index = static_cast<uint16_t *>(
-			device->map_host_buffer(*staging.render_state_index_gpu,
-			                        MEMORY_ACCESS_WRITE_BIT));
-
-	if (staging.mapped_positions && staging.mapped_attributes && staging.mapped_shader_state_index &&
-	    staging.mapped_render_state && staging.mapped_render_state_index)
-	{
-		staging.positions = staging.positions_gpu;
-		staging.attributes = staging.attributes_gpu;
-		staging.shader_state_index = staging.shader_state_index_gpu;
-		staging.render_state = staging.render_state_gpu;
-		staging.render_state_index = staging.render_state_index_gpu;
-		staging.host_visible = true;
+	if (device->map_host_buffer(*buffer.gpu, MEMORY_ACCESS_WRITE_BIT))
+	{
+		device->unmap_host_buffer(*buffer.gpu, MEMORY_ACCESS_WRITE_BIT);
+		buffer.host = buffer.gpu;
 	}
 	else
 	{
 		info.domain = BufferDomain::Host;
 		info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+		buffer.host = device->create_buffer(info);
+	}
+
+	return buffer;
+}
 
-		info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupPos);
-		staging.positions = device->create_buffer(info);
+RasterizerGPU::Impl::StagingBuffer &RasterizerGPU::Impl::acquire_staging_buffer()
+{
+	unsigned index = staging_ring.empty() ? 0u : (staging_ring_index + 1) % unsigned(staging_ring.size());
 
-		info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupAttr);
-		staging.attributes = device->create_buffer(info);
+	// Rather than stalling on a buffer the GPU is still reading from, grow the ring.
+	// After warm-up, the ring is large enough to cover all batches in flight and we never allocate.
+	bool need_new_buffer = staging_ring.empty();
+	if (!need_new_buffer && staging_ring.size() < MAX_NUM_STAGING_BUFFERS)
+	{
+		auto &fence = staging_ring[index].fence;
+		need_new_buffer = fence && !fence->wait_timeout(0);
+	}
 
-		info.size = MAX_PRIMITIVES * sizeof(uint8_t);
-		staging.shader_state_index = device->create_buffer(info);
+	if (need_new_buffer)
+		staging_ring.insert(staging_ring.begin() + index, create_staging_buffer());
 
-		info.size = MAX_PRIMITIVES * sizeof(uint16_t);
-		staging.render_state_index = device->create_buffer(info);
+	auto &buffer = staging_ring[index];
+	if (buffer.fence)
+	{
+		buffer.fence->wait();
+		buffer.fence.reset();
+	}
 
-		info.size = MAX_NUM_RENDER_STATE_INDICES * sizeof(RenderState);
-		staging.render_state = device->create_buffer(info);
+	staging_ring_index = index;
+	return buffer;
+}
 
-		staging.mapped_positions = static_cast<PrimitiveSetupPos *>(
-				device->map_host_buffer(*staging.positions,
-				                        MEMORY_ACCESS_WRITE_BIT));
-		staging.mapped_attributes = static_cast<PrimitiveSetupAttr *>(
-				device->map_host_buffer(*staging.attributes,
-				                        MEMORY_ACCESS_WRITE_BIT));
-		staging.mapped_shader_state_index = static_cast<uint8_t *>(
-				device->map_host_buffer(*staging.shader_state_index,
-				                        MEMORY_ACCESS_WRITE_BIT));
+void RasterizerGPU::Impl::set_staging_storage_buffer(CommandBuffer &cmd, unsigned binding, const StagingRegion &region) const
+{
+	cmd.set_storage_buffer(0, binding, *staging.gpu, region.offset, region.size);
+}
 
-		staging.mapped_render_state = static_cast<RenderState *>(
-				device->map_host_buffer(*staging.render_state,
-				                        MEMORY_ACCESS_WRITE_BIT));
-		staging.mapped_render_state_index = static_cast<uint16_t *>(
-				device->map_host_buffer(*staging.render_state_index,
-				                        MEMORY_ACCESS_WRITE_BIT));
+void RasterizerGPU::Impl::set_staging_uniform_buffer(CommandBuffer &cmd, unsigned binding, const StagingRegion &region) const
+{
+	cmd.set_uniform_buffer(0, binding, *staging.gpu, region.offset, region.size);
+}
 
-		staging.host_visible = false;
-	}
+void RasterizerGPU::Impl::begin_staging()
+{
+	auto &buffer = acquire_staging_buffer();
+	staging.gpu = buffer.gpu;
+	staging.host = buffer.host;
+	staging.host_visible = buffer.gpu == buffer.host;
+
+	auto *mapped = static_cast<uint8_t *>(device->map_host_buffer(*staging.host, MEMORY_ACCESS_WRITE_BIT));
+	staging.mapped_positions = reinterpret_cast<PrimitiveSetupPos *>(mapped + staging_layout.positions.offset);
+	staging.mapped_attributes = reinterpret_cast<PrimitiveSetupAttr *>(mapped + staging_layout.attributes.offset);
+	staging.mapped_bboxes = reinterpret_cast<PrimitiveSetupBBox *>(mapped + staging_layout.bboxes.offset);
+	staging.mapped_shader_state_index = mapped + staging_layout.shader_state_index.offset;
+	staging.mapped_render_state_index = reinterpret_cast<uint16_t *>(mapped + staging_layout.render_state_index.offset);
+	staging.mapped_render_state = reinterpret_cast<RenderState *>(mapped + staging_layout.render_state.offset);
 
 	staging.count = 0;
 	staging.num_conservative_tile_instances = 0;
@@ -374,34 +999,39 @@ void RasterizerGPU::Impl::begin_staging()
 void RasterizerGPU::Impl::end_staging()
 {
 	if (staging.mapped_positions)
-		device->unmap_host_buffer(*staging.positions, MEMORY_ACCESS_WRITE_BIT);
-	if (staging.mapped_attributes)
-		device->unmap_host_buffer(*staging.attributes, MEMORY_ACCESS_WRITE_BIT);
-	if (staging.mapped_shader_state_index)
-		device->unmap_host_buffer(*staging.shader_state_index, MEMORY_ACCESS_WRITE_BIT);
-	if (staging.mapped_render_state_index)
-		device->unmap_host_buffer(*staging.render_state_index, MEMORY_ACCESS_WRITE_BIT);
-	if (staging.mapped_render_state)
-		device->unmap_host_buffer(*staging.render_state, MEMORY_ACCESS_WRITE_BIT);
+		device->unmap_host_buffer(*staging.host, MEMORY_ACCESS_WRITE_BIT);
 
 	staging.mapped_positions = nullptr;
 	staging.mapped_attributes = nullptr;
+	staging.mapped_bboxes = nullptr;
 	staging.mapped_shader_state_index = nullptr;
 	staging.mapped_render_state_index = nullptr;
 	staging.mapped_render_state = nullptr;
 
 	if (!staging.host_visible && staging.count != 0)
 	{
+		const auto copy_region = [&](CommandBuffer &cmd, const StagingRegion &region, VkDeviceSize size) {
+			cmd.copy_buffer(*staging.gpu, region.offset, *staging.host, region.offset, size);
+		};
+
 		auto cmd = device->request_command_buffer(CommandBuffer::Type::AsyncTransfer);
-		cmd->copy_buffer(*staging.positions_gpu, 0, *staging.positions, 0, staging.count * sizeof(PrimitiveSetupPos));
-		cmd->copy_buffer(*staging.attributes_gpu, 0, *staging.attributes, 0, staging.count * sizeof(PrimitiveSetupAttr));
-		cmd->copy_buffer(*staging.shader_state_index_gpu, 0, *staging.shader_state_index, 0, staging.count * sizeof(uint8_t));
-		cmd->copy_buffer(*staging.render_state_index_gpu, 0, *staging.render_state_index, 0, staging.count * sizeof(uint16_t));
-		cmd->copy_buffer(*staging.render_state_gpu, 0, *staging.render_state, 0, state.render_state_count * sizeof(RenderState));
+		copy_region(*cmd, staging_layout.positions, staging.count * sizeof(PrimitiveSetupPos));
+		copy_region(*cmd, staging_layout.attributes, staging.count * sizeof(PrimitiveSetupAttr));
+		copy_region(*cmd, staging_layout.bboxes, staging.count * sizeof(PrimitiveSetupBBox));
+		copy_region(*cmd, staging_layout.shader_state_index, staging.count * sizeof(uint8_t));
+		copy_region(*cmd, staging_layout.render_state_index, staging.count * sizeof(uint16_t));
+		copy_region(*cmd, staging_layout.render_state, state.render_state_count * sizeof(RenderState));
 		Semaphore sem;
 		device->submit(cmd, nullptr, 1, &sem);
 		device->add_wait_semaphore(async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic, sem, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
 	}
+
+	state.deferred = deferred_shading && !ubershader && !state.needs_forward_shading;
+
+	// The footprint of triangles set up on the GPU is unknown here, and no tile instance budget covers every
+	// primitive without dropping some. Those batches render with the ubershader ROP, which needs no tile
+	// instances, like deferred batches do.
+	state.ubershader_rop = ubershader || (!state.deferred && !triangle_setup.jobs.empty());
 }
 
 void RasterizerGPU::Impl::clear_indirect_buffer(CommandBuffer &cmd)
@@ -416,6 +1046,145 @@ void RasterizerGPU::Impl::clear_indirect_buffer(CommandBuffer &cmd)
 	cmd.set_specialization_constant_mask(0);
 }
 
+void RasterizerGPU::Impl::run_vertex_transform(CommandBuffer &cmd, const Buffer &vertex_buffer,
+                                               const Buffer &transform_buffer, VkDeviceSize transform_offset)
+{
+	cmd.begin_region("vertex-transform");
+	cmd.set_program("assets://shaders/vertex_transform.comp");
+	cmd.set_storage_buffer(0, 1, transform_buffer, transform_offset,
+	                       triangle_setup.transforms.size() * sizeof(VertexTransformGPU));
+	cmd.set_storage_buffer(0, 2, vertex_buffer);
+
+	struct Registers
+	{
+		uint32_t num_vertices;
+		uint32_t transform_index;
+		uint32_t output_offset;
+	};
+
+	auto base_offset = uint32_t(triangle_setup.vertices.size());
+	for (auto &job : triangle_setup.transform_jobs)
+	{
+		cmd.set_storage_buffer(0, 0, *job.vertices);
+		Registers registers = { job.num_vertices, job.transform_index, base_offset + job.output_offset };
+		cmd.push_constants(&registers, 0, sizeof(registers));
+		cmd.dispatch((job.num_vertices + 63) / 64, 1, 1);
+	}
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	cmd.end_region();
+}
+
+void RasterizerGPU::Impl::grow_setup_buffer(BufferHandle &buffer, BufferDomain domain, VkBufferUsageFlags usage,
+                                            VkDeviceSize size)
+{
+	VkDeviceSize capacity = buffer ? buffer->get_create_info().size : 0;
+	if (size <= capacity)
+		return;
+
+	BufferCreateInfo info;
+	info.domain = domain;
+	info.usage = usage;
+	info.size = std::max(capacity * 2, MIN_SETUP_BUFFER_SIZE);
+	while (info.size < size)
+		info.size *= 2;
+	buffer = device->create_buffer(info);
+}
+
+void RasterizerGPU::Impl::run_triangle_setup(CommandBuffer &cmd)
+{
+	// Every path which sets up triangles submits with the fence of the current staging buffer.
+	auto &staging_buffer = staging_ring[staging_ring_index];
+	VkDeviceSize alignment = std::max<VkDeviceSize>(device->get_gpu_properties().limits.minStorageBufferOffsetAlignment, 16);
+	VkDeviceSize index_size = triangle_setup.indices.size() * sizeof(uint32_t);
+	VkDeviceSize vertex_size = triangle_setup.vertices.size() * sizeof(Vertex);
+	VkDeviceSize transform_size = triangle_setup.transforms.size() * sizeof(VertexTransformGPU);
+	VkDeviceSize vertex_offset = (index_size + alignment - 1) & ~(alignment - 1);
+	VkDeviceSize transform_offset = (vertex_offset + vertex_size + alignment - 1) & ~(alignment - 1);
+
+	grow_setup_buffer(staging_buffer.setup_input, BufferDomain::Host,
+	                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	                  transform_offset + transform_size);
+	auto &input = *staging_buffer.setup_input;
+	auto *mapped = static_cast<uint8_t *>(device->map_host_buffer(input, MEMORY_ACCESS_WRITE_BIT));
+	memcpy(mapped, triangle_setup.indices.data(), index_size);
+	if (vertex_size)
+		memcpy(mapped + vertex_offset, triangle_setup.vertices.data(), vertex_size);
+	if (transform_size)
+		memcpy(mapped + transform_offset, triangle_setup.transforms.data(), transform_size);
+	device->unmap_host_buffer(input, MEMORY_ACCESS_WRITE_BIT);
+
+	const Buffer *vertex_buffer = nullptr;
+	if (!triangle_setup.transform_jobs.empty())
+	{
+		// Transformed vertices never leave the GPU, CPU vertices are copied in front of them.
+		grow_setup_buffer(staging_buffer.setup_vertices, BufferDomain::Device,
+		                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		                  (triangle_setup.vertices.size() + triangle_setup.num_transformed_vertices) * sizeof(Vertex));
+		vertex_buffer = staging_buffer.setup_vertices.get();
+
+		if (vertex_size)
+		{
+			cmd.copy_buffer(*vertex_buffer, 0, input, vertex_offset, vertex_size);
+			cmd.barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		}
+
+		run_vertex_transform(cmd, *vertex_buffer, input, transform_offset);
+	}
+
+	cmd.begin_region("triangle-setup");
+	cmd.set_program("assets://shaders/triangle_setup.comp", {{ "TILE_SIZE", tile_size }});
+	if (vertex_buffer)
+		cmd.set_storage_buffer(0, 0, *vertex_buffer);
+	else
+		cmd.set_storage_buffer(0, 0, input, vertex_offset, vertex_size);
+	cmd.set_storage_buffer(0, 1, input, 0, index_size);
+	set_staging_storage_buffer(cmd, 2, staging_layout.positions);
+	set_staging_storage_buffer(cmd, 3, staging_layout.attributes);
+	set_staging_storage_buffer(cmd, 4, staging_layout.bboxes);
+
+	struct Registers
+	{
+		int32_t scissor[4];
+		float viewport_offset[2];
+		float viewport_size[2];
+		float min_depth;
+		float max_depth;
+		uint32_t vertex_offset;
+		uint32_t index_offset;
+		uint32_t num_triangles;
+		uint32_t primitive_offset;
+		uint32_t cull_mode;
+	};
+
+	for (auto &job : triangle_setup.jobs)
+	{
+		Registers registers = {};
+		memcpy(registers.scissor, job.scissor, sizeof(registers.scissor));
+		registers.viewport_offset[0] = job.viewport.x;
+		registers.viewport_offset[1] = job.viewport.y;
+		registers.viewport_size[0] = job.viewport.width;
+		registers.viewport_size[1] = job.viewport.height;
+		registers.min_depth = job.viewport.min_depth;
+		registers.max_depth = job.viewport.max_depth;
+		registers.vertex_offset = job.vertex_offset;
+		if (job.transformed)
+			registers.vertex_offset += uint32_t(triangle_setup.vertices.size());
+		registers.index_offset = job.index_offset;
+		registers.num_triangles = job.num_triangles;
+		registers.primitive_offset = job.primitive_offset;
+		registers.cull_mode = uint32_t(job.cull_mode);
+		cmd.push_constants(&registers, 0, sizeof(registers));
+		cmd.dispatch((job.num_triangles + 63) / 64, 1, 1);
+	}
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	cmd.end_region();
+}
+
 void RasterizerGPU::Impl::binning_low_res_prepass(CommandBuffer &cmd)
 {
 	uint32_t width = std::max(color.width, depth.width);
@@ -423,9 +1192,7 @@ void RasterizerGPU::Impl::binning_low_res_prepass(CommandBuffer &cmd)
 
 	cmd.begin_region("binning-low-res-prepass");
 	cmd.set_storage_buffer(0, 0, *binning.mask_buffer_low_res);
-	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
-	cmd.set_uniform_buffer(0, 2, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 3, *staging.render_state_gpu);
+	set_staging_storage_buffer(cmd, 1, staging_layout.bboxes);
 
 	auto &features = device->get_device_features();
 	uint32_t subgroup_size = features.subgroup_properties.subgroupSize;
@@ -478,19 +1245,23 @@ void RasterizerGPU::Impl::binning_full_res(CommandBuffer &cmd, bool ubershader)
 	uint32_t height = std::max(color.height, depth.height);
 	cmd.begin_region("binning-full-res");
 	cmd.set_storage_buffer(0, 0, *binning.mask_buffer[tile_instance_data.index]);
-	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
+	set_staging_storage_buffer(cmd, 1, staging_layout.positions);
 	cmd.set_storage_buffer(0, 2, *binning.mask_buffer_low_res);
 	cmd.set_storage_buffer(0, 3, *binning.mask_buffer_coarse[tile_instance_data.index]);
 
-	cmd.set_uniform_buffer(0, 4, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 5, *staging.render_state_gpu);
+	set_staging_storage_buffer(cmd, 4, staging_layout.render_state_index);
+	set_staging_uniform_buffer(cmd, 5, staging_layout.render_state);
 
 	if (!ubershader)
 	{
 		cmd.set_storage_buffer(0, 6, *tile_count.tile_offset[tile_instance_data.index]);
 		cmd.set_storage_buffer(0, 7, *raster_work.item_count_per_variant);
-		cmd.set_storage_buffer(0, 8, *raster_work.work_list_per_variant);
-		cmd.set_storage_buffer(0, 9, *staging.shader_state_index_gpu);
+		cmd.set_storage_buffer(0, 8, *raster_work.work_list_unsorted);
+		set_staging_storage_buffer(cmd, 9, staging_layout.shader_state_index);
+		set_staging_storage_buffer(cmd, 10, staging_layout.attributes);
+		cmd.set_storage_buffer(0, 11, *hiz.ranges);
+		cmd.set_storage_buffer(0, 12, *binning.touched_tile_stamps);
+		cmd.set_storage_buffer(0, 13, *binning.touched_tiles[tile_instance_data.index]);
 	}
 
 	auto &features = device->get_device_features();
@@ -576,16 +1347,46 @@ bool RasterizerGPU::Impl::supports_subgroup_size_control(uint32_t minimum_size,
 	return true;
 }
 
-void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
+void RasterizerGPU::Impl::compact_work_list(CommandBuffer &cmd)
 {
-	cmd.begin_region("dispatch-combiner-work");
-	cmd.set_storage_buffer(0, 1, *tile_instance_data.color[tile_instance_data.index]);
-	cmd.set_storage_buffer(0, 2, *tile_instance_data.depth[tile_instance_data.index]);
-	cmd.set_storage_buffer(0, 3, *tile_instance_data.flags[tile_instance_data.index]);
-	cmd.set_storage_buffer(0, 4, *staging.positions_gpu);
-	cmd.set_storage_buffer(0, 5, *staging.attributes_gpu);
-	cmd.set_uniform_buffer(0, 6, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 7, *staging.render_state_gpu);
+	cmd.begin_region("compact-work-list");
+
+	// Prefix sum over the per-variant counts, which also sets up the indirect scatter dispatch.
+	cmd.set_program("assets://shaders/work_list_offsets.comp");
+	cmd.set_specialization_constant_mask(1);
+	cmd.set_specialization_constant(0, MAX_NUM_SHADER_STATE_INDICES);
+	cmd.set_storage_buffer(0, 0, *raster_work.item_count_per_variant);
+	cmd.set_storage_buffer(0, 1, *raster_work.work_list_offsets);
+	cmd.dispatch(1, 1, 1);
+	cmd.set_specialization_constant_mask(0);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+	            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+
+	const VkDeviceSize scatter_args_offset = MAX_NUM_SHADER_STATE_INDICES * (4 * sizeof(uint32_t));
+	cmd.set_program("assets://shaders/work_list_scatter.comp");
+	cmd.set_storage_buffer(0, 0, *raster_work.work_list_unsorted);
+	cmd.set_storage_buffer(0, 1, *raster_work.work_list);
+	cmd.set_storage_buffer(0, 2, *raster_work.work_list_offsets);
+	cmd.set_storage_buffer(0, 3, *raster_work.item_count_per_variant, scatter_args_offset, 4 * sizeof(uint32_t));
+	cmd.dispatch_indirect(*raster_work.item_count_per_variant, scatter_args_offset);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	cmd.end_region();
+}
+
+void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
+{
+	cmd.begin_region("dispatch-combiner-work");
+	cmd.set_storage_buffer(0, 1, *tile_instance_data.color[tile_instance_data.index]);
+	cmd.set_storage_buffer(0, 2, *tile_instance_data.depth[tile_instance_data.index]);
+	cmd.set_storage_buffer(0, 3, *tile_instance_data.flags[tile_instance_data.index]);
+	set_staging_storage_buffer(cmd, 4, staging_layout.positions);
+	set_staging_storage_buffer(cmd, 5, staging_layout.attributes);
+	set_staging_storage_buffer(cmd, 6, staging_layout.render_state_index);
+	set_staging_uniform_buffer(cmd, 7, staging_layout.render_state);
 	cmd.set_storage_buffer(0, 8, *vram_buffer);
 
 	auto &features = device->get_device_features();
@@ -639,12 +1440,14 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 
 	cmd.set_specialization_constant_mask(1);
 
+	cmd.set_storage_buffer(0, 0, *raster_work.work_list);
+	cmd.set_storage_buffer(0, 9, *raster_work.work_list_offsets);
+
 	for (unsigned variant = 0; variant < state.shader_state_count; variant++)
 	{
 		cmd.set_specialization_constant(0, state.shader_states[variant]);
-		cmd.set_storage_buffer(0, 0, *raster_work.work_list_per_variant,
-		                       variant * (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork),
-		                       (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork));
+		uint32_t variant_index = variant;
+		cmd.push_constants(&variant_index, 0, sizeof(variant_index));
 		cmd.dispatch_indirect(*raster_work.item_count_per_variant, 16 * variant);
 	}
 
@@ -676,6 +1479,18 @@ void RasterizerGPU::Impl::set_fb_info(CommandBuffer &cmd)
 	fb_info->depth_width = depth.width;
 	fb_info->depth_height = depth.height;
 	fb_info->depth_stride = depth.stride >> 1u;
+
+	fb_info->tile_binning_stride = tile_binning_stride;
+	fb_info->tile_binning_stride_coarse = tile_binning_stride_coarse;
+
+	fb_info->color_clear_value = color.clear_value;
+	fb_info->depth_clear_value = depth.clear_value;
+
+	fb_info->tile_grid_stride = max_tiles_x;
+	fb_info->tile_grid_stride_low_res = max_tiles_x_low_res;
+
+	fb_info->hiz_cull_mode = hiz.cull_mode;
+	fb_info->touched_tile_stamp = binning.touched_tile_stamp;
 }
 
 void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
@@ -687,11 +1502,13 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 	cmd.set_storage_buffer(0, 0, *vram_buffer);
 	cmd.set_storage_buffer(0, 1, *binning.mask_buffer[tile_instance_data.index]);
 	cmd.set_storage_buffer(0, 2, *binning.mask_buffer_coarse[tile_instance_data.index]);
-	cmd.set_storage_buffer(0, 3, *staging.positions_gpu);
-	cmd.set_storage_buffer(0, 4, *staging.attributes_gpu);
-	cmd.set_uniform_buffer(0, 5, *staging.shader_state_index_gpu);
-	cmd.set_uniform_buffer(0, 6, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 7, *staging.render_state_gpu);
+	set_staging_storage_buffer(cmd, 3, staging_layout.positions);
+	set_staging_storage_buffer(cmd, 4, staging_layout.attributes);
+	set_staging_storage_buffer(cmd, 5, staging_layout.shader_state_index);
+	set_staging_storage_buffer(cmd, 6, staging_layout.render_state_index);
+	set_staging_uniform_buffer(cmd, 7, staging_layout.render_state);
+	cmd.set_storage_buffer(0, 8, *fast_clear.color);
+	cmd.set_storage_buffer(0, 9, *fast_clear.depth);
 
 	auto &features = device->get_device_features();
 	const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BASIC_BIT |
@@ -746,10 +1563,32 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 	cmd.enable_subgroup_size_control(false);
 }
 
-void RasterizerGPU::Impl::run_rop(CommandBuffer &cmd)
+void RasterizerGPU::Impl::run_rop_deferred(CommandBuffer &cmd)
 {
 	uint32_t width = std::max(color.width, depth.width);
 	uint32_t height = std::max(color.height, depth.height);
+	cmd.begin_region("run-rop-deferred");
+	cmd.set_program("assets://shaders/rop_deferred.comp", {
+		{"TILE_SIZE", tile_size}
+	});
+
+	cmd.set_storage_buffer(0, 0, *vram_buffer);
+	cmd.set_storage_buffer(0, 1, *binning.mask_buffer[tile_instance_data.index]);
+	cmd.set_storage_buffer(0, 2, *binning.mask_buffer_coarse[tile_instance_data.index]);
+	set_staging_storage_buffer(cmd, 3, staging_layout.positions);
+	set_staging_storage_buffer(cmd, 4, staging_layout.attributes);
+	set_staging_storage_buffer(cmd, 5, staging_layout.render_state_index);
+	set_staging_uniform_buffer(cmd, 6, staging_layout.render_state);
+	cmd.set_storage_buffer(0, 7, *fast_clear.color);
+	cmd.set_storage_buffer(0, 8, *fast_clear.depth);
+	cmd.set_storage_buffer(0, 9, *hiz.ranges);
+
+	cmd.dispatch((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, 1);
+	cmd.end_region();
+}
+
+void RasterizerGPU::Impl::run_rop(CommandBuffer &cmd)
+{
 	cmd.begin_region("run-rop");
 	cmd.set_program("assets://shaders/rop.comp", {
 		{"TILE_SIZE", tile_size}
@@ -762,18 +1601,36 @@ void RasterizerGPU::Impl::run_rop(CommandBuffer &cmd)
 	cmd.set_storage_buffer(0, 4, *tile_instance_data.depth[tile_instance_data.index]);
 	cmd.set_storage_buffer(0, 5, *tile_instance_data.flags[tile_instance_data.index]);
 	cmd.set_storage_buffer(0, 6, *tile_count.tile_offset[tile_instance_data.index]);
-	cmd.set_uniform_buffer(0, 7, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 8, *staging.render_state_gpu);
-
-	cmd.dispatch((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, 1);
+	set_staging_storage_buffer(cmd, 7, staging_layout.render_state_index);
+	set_staging_uniform_buffer(cmd, 8, staging_layout.render_state);
+	cmd.set_storage_buffer(0, 9, *fast_clear.color);
+	cmd.set_storage_buffer(0, 10, *fast_clear.depth);
+	cmd.set_storage_buffer(0, 11, *hiz.ranges);
+	cmd.set_storage_buffer(0, 12, *binning.touched_tiles[tile_instance_data.index]);
+
+	// One workgroup per tile binning touched. Other tiles are unchanged by the batch,
+	// so pending clears and Hi-Z ranges recorded for them stay valid.
+	cmd.dispatch_indirect(*binning.touched_tiles[tile_instance_data.index], 0);
 	cmd.end_region();
 }
 
-void RasterizerGPU::Impl::flush_ubershader()
+void RasterizerGPU::Impl::submit_batch(Fence *fence)
 {
-	end_staging();
-	if (staging.count == 0)
-		return;
+	if (state.ubershader_rop || state.deferred)
+		flush_ubershader(fence, state.deferred);
+	else
+		flush_split(fence);
+}
+
+// Deferred batches share this path, with rop_deferred.comp in place of the ubershader.
+void RasterizerGPU::Impl::flush_ubershader(Fence *fence, bool deferred)
+{
+	prepare_batch_slot(tile_instance_data.index);
+	record_flush_stats();
+	// Deferred batches and batches with GPU triangle setup take their turn in the same batch slots as
+	// split batches. Deferred batches keep Hi-Z current, the ubershader ROP does not, see below.
+	if (!ubershader)
+		update_hiz_cull_mode();
 
 	auto queue_type = async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic;
 
@@ -781,6 +1638,14 @@ void RasterizerGPU::Impl::flush_ubershader()
 
 	set_fb_info(*cmd);
 
+	if (!triangle_setup.jobs.empty())
+	{
+		auto setup_start = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		run_triangle_setup(*cmd);
+		auto setup_end = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		register_stage_time(setup_start, setup_end, RasterizerStage::TriangleSetup, "triangle-setup");
+	}
+
 	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
 	binning_low_res_prepass(*cmd);
@@ -788,7 +1653,7 @@ void RasterizerGPU::Impl::flush_ubershader()
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t0, t1, "binning-low-res-prepass");
+	register_stage_time(t0, t1, RasterizerStage::BinningLowRes, "binning-low-res-prepass");
 	device->submit(cmd);
 
 	auto &rop_sem = tile_instance_data.rop_complete[tile_instance_data.index];
@@ -806,7 +1671,7 @@ void RasterizerGPU::Impl::flush_ubershader()
 	binning_full_res(*cmd, true);
 
 	auto t2 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t1, t2, "binning-full-res");
+	register_stage_time(t1, t2, RasterizerStage::BinningFullRes, "binning-full-res");
 
 	Semaphore sem;
 	device->submit(cmd, nullptr, 1, &sem);
@@ -822,25 +1687,73 @@ void RasterizerGPU::Impl::flush_ubershader()
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
 
-	run_rop_ubershader(*cmd);
+	if (deferred)
+		run_rop_deferred(*cmd);
+	else
+		run_rop_ubershader(*cmd);
+	generic_since_upload = true;
 
 	auto t3 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t2, t3, "rop-ubershader");
+	register_stage_time(t2, t3, RasterizerStage::ROP, deferred ? "rop-deferred" : "rop-ubershader");
 
 	sem.reset();
-	device->submit(cmd, nullptr, 1, &sem);
+	device->submit(cmd, fence, 1, &sem);
 	tile_instance_data.rop_complete[tile_instance_data.index] = sem;
 	reset_staging();
 
-	device->register_time_interval(t0, t3, "iteration");
-	tile_instance_data.index ^= 1;
+	// The ubershader ROP leaves per-tile depth ranges behind what it wrote.
+	if (!ubershader && !deferred)
+		invalidate_hiz();
+
+	register_stage_time(t0, t3, RasterizerStage::Batch, "iteration");
+	advance_batch_slot();
 }
 
-void RasterizerGPU::Impl::flush_split()
+void RasterizerGPU::Impl::update_hiz_cull_mode()
 {
-	end_staging();
-	if (staging.count == 0)
-		return;
+	uint64_t index = hiz.flush_index++;
+	if (state.depth_changes & DEPTH_CHANGE_DECREASE_BIT)
+		hiz.last_decrease = index;
+	if (state.depth_changes & DEPTH_CHANGE_INCREASE_BIT)
+		hiz.last_increase = index;
+
+	// Binning waits for the ROP pass of the flush which last used this batch slot.
+	hiz.cull_mode = 0;
+	if (index >= tile_instance_data.num_slots)
+	{
+		uint64_t completed = index - tile_instance_data.num_slots;
+		// Less-than tests can only be culled against the tile maximum while depth has not increased.
+		if (hiz.last_increase <= completed)
+			hiz.cull_mode |= HIZ_CULL_LESS_BIT;
+		if (hiz.last_decrease <= completed)
+			hiz.cull_mode |= HIZ_CULL_GREATER_BIT;
+	}
+}
+
+void RasterizerGPU::Impl::invalidate_hiz(uint32_t range)
+{
+	hiz.last_decrease = hiz.flush_index;
+	hiz.last_increase = hiz.flush_index;
+
+	// ROP does not revisit tiles a batch leaves alone, so they need a range which holds for the new contents.
+	auto cmd = device->request_command_buffer();
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT,
+	             VK_ACCESS_TRANSFER_WRITE_BIT);
+	cmd->fill_buffer(*hiz.ranges, range);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT,
+	             VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	device->submit(cmd);
+}
+
+void RasterizerGPU::Impl::flush_split(Fence *fence)
+{
+	prepare_batch_slot(tile_instance_data.index);
+	record_flush_stats();
+	update_hiz_cull_mode();
 
 	auto queue_type = async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic;
 
@@ -852,6 +1765,14 @@ void RasterizerGPU::Impl::flush_split()
 	// Clear indirect buffer.
 	clear_indirect_buffer(*cmd);
 
+	if (!triangle_setup.jobs.empty())
+	{
+		auto setup_start = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		run_triangle_setup(*cmd);
+		auto setup_end = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		register_stage_time(setup_start, setup_end, RasterizerStage::TriangleSetup, "triangle-setup");
+	}
+
 	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
 	// Binning low-res prepass.
@@ -861,7 +1782,7 @@ void RasterizerGPU::Impl::flush_split()
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t0, t1, "binning-low-res-prepass");
+	register_stage_time(t0, t1, RasterizerStage::BinningLowRes, "binning-low-res-prepass");
 	device->submit(cmd);
 
 	// Need to wait until an earlier pass of ROP completes.
@@ -874,11 +1795,20 @@ void RasterizerGPU::Impl::flush_split()
 		rop_sem.reset();
 	}
 
+	// Stamps must differ from any left in the buffer, which starts out zeroed.
+	if (++binning.touched_tile_stamp == 0)
+		binning.touched_tile_stamp = 1;
+
 	cmd = device->request_command_buffer(queue_type);
 	set_fb_info(*cmd);
 
 	t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
+	// Reset the touched tile count, the ROP pass which last read it has completed.
+	cmd->fill_buffer(*binning.touched_tiles[tile_instance_data.index], 0, 0, sizeof(uint32_t));
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
 	// Binning at full-resolution.
 	binning_full_res(*cmd, false);
 
@@ -886,13 +1816,15 @@ void RasterizerGPU::Impl::flush_split()
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
 	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
+	compact_work_list(*cmd);
+
 	auto t2 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t1, t2, "binning-full-res");
+	register_stage_time(t1, t2, RasterizerStage::BinningFullRes, "binning-full-res");
 
 	dispatch_combiner_work(*cmd);
 
 	auto t3 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t2, t3, "dispatch-combiner-work");
+	register_stage_time(t2, t3, RasterizerStage::Combiner, "dispatch-combiner-work");
 
 	// Hand off shaded result to ROP.
 	Semaphore sem;
@@ -905,27 +1837,28 @@ void RasterizerGPU::Impl::flush_split()
 
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
 	// ROP.
 	run_rop(*cmd);
+	generic_since_upload = true;
 
 	auto t4 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval(t3, t4, "rop");
+	register_stage_time(t3, t4, RasterizerStage::ROP, "rop");
 
-	device->register_time_interval(t0, t4, "iteration");
+	register_stage_time(t0, t4, RasterizerStage::Batch, "iteration");
 
 	sem.reset();
-	device->submit(cmd, nullptr, 1, &sem);
+	device->submit(cmd, fence, 1, &sem);
 	tile_instance_data.rop_complete[tile_instance_data.index] = sem;
 
 	reset_staging();
 
-	tile_instance_data.index ^= 1;
+	advance_batch_slot();
 }
 
-void RasterizerGPU::Impl::init_binning_buffers()
+void RasterizerGPU::Impl::init_low_res_mask_buffer()
 {
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
@@ -933,32 +1866,27 @@ void RasterizerGPU::Impl::init_binning_buffers()
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 
-	info.size = max_tiles_x * max_tiles_y * TILE_BINNING_STRIDE * sizeof(uint32_t);
-	for (auto &mask_buffer : binning.mask_buffer)
-		mask_buffer = device->create_buffer(info);
-
-	info.size = max_tiles_x_low_res * max_tiles_y_low_res * TILE_BINNING_STRIDE * sizeof(uint32_t);
+	// Only consumed by the binning queue, so one copy is shared between all slots.
+	info.size = tile_grid_capacity_low_res * tile_binning_stride * sizeof(uint32_t);
 	binning.mask_buffer_low_res = device->create_buffer(info);
-
-	info.size = max_tiles_x * max_tiles_y * TILE_BINNING_STRIDE_COARSE * sizeof(uint32_t);
-	for (auto &mask_buffer : binning.mask_buffer_coarse)
-		mask_buffer = device->create_buffer(info);
 }
 
-void RasterizerGPU::Impl::init_prefix_sum_buffers()
+void RasterizerGPU::Impl::init_binning_buffers()
 {
+	init_low_res_mask_buffer();
+
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
 	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 
-	info.size = max_tiles_x * max_tiles_y * TILE_BINNING_STRIDE * sizeof(uint16_t);
-	for (auto &offset : tile_count.tile_offset)
-		offset = device->create_buffer(info);
+	info.size = tile_grid_capacity * sizeof(uint32_t);
+	info.misc = BUFFER_MISC_ZERO_INITIALIZE_BIT;
+	binning.touched_tile_stamps = device->create_buffer(info);
 }
 
-void RasterizerGPU::Impl::init_tile_buffers()
+void RasterizerGPU::Impl::prepare_batch_slot(unsigned slot)
 {
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
@@ -966,15 +1894,204 @@ void RasterizerGPU::Impl::init_tile_buffers()
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 
-	info.size = MAX_NUM_TILE_INSTANCES * tile_size * tile_size * sizeof(uint32_t);
-	for (auto &color : tile_instance_data.color)
-		color = device->create_buffer(info);
-	info.size = MAX_NUM_TILE_INSTANCES * tile_size * tile_size * sizeof(uint16_t);
-	for (auto &depth : tile_instance_data.depth)
-		depth = device->create_buffer(info);
-	info.size = MAX_NUM_TILE_INSTANCES * tile_size * tile_size * sizeof(uint8_t);
-	for (auto &flags : tile_instance_data.flags)
-		flags = device->create_buffer(info);
+	if (!binning.mask_buffer[slot])
+	{
+		info.size = tile_grid_capacity * tile_binning_stride * sizeof(uint32_t);
+		binning.mask_buffer[slot] = device->create_buffer(info);
+		info.size = tile_grid_capacity * tile_binning_stride_coarse * sizeof(uint32_t);
+		binning.mask_buffer_coarse[slot] = device->create_buffer(info);
+	}
+
+	// Only the split path writes tile instances.
+	if (state.ubershader_rop || state.deferred)
+		return;
+
+	if (!tile_count.tile_offset[slot])
+	{
+		info.size = tile_grid_capacity * tile_binning_stride * sizeof(uint32_t);
+		tile_count.tile_offset[slot] = device->create_buffer(info);
+
+		// Dispatch arguments (0, 1, 1) followed by one packed tile coordinate per tile.
+		// Only the workgroup count is reset per batch.
+		std::vector<uint32_t> touched_tiles(4 + tile_grid_capacity);
+		touched_tiles[1] = 1;
+		touched_tiles[2] = 1;
+		BufferCreateInfo list_info = info;
+		list_info.size = touched_tiles.size() * sizeof(uint32_t);
+		list_info.usage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+		binning.touched_tiles[slot] = device->create_buffer(list_info, touched_tiles.data());
+	}
+
+	// Buffers allocated at the other tile size hold as many pixels in fewer or more tile instances.
+	if (tile_instance_data.tile_size[slot] != tile_size)
+	{
+		int old_size = tile_instance_data.tile_size[slot];
+		tile_instance_data.capacity[slot] = tile_instance_data.capacity[slot] * (old_size * old_size) / (tile_size * tile_size);
+		tile_instance_data.tile_size[slot] = tile_size;
+	}
+
+	unsigned num_instances = staging.num_conservative_tile_instances;
+	if (tile_instance_data.capacity[slot] == 0 || num_instances > tile_instance_data.capacity[slot])
+	{
+		// Grow geometrically so a slot settles on the working set of a scene after a few batches.
+		unsigned capacity = std::max(tile_instance_data.capacity[slot] * 2, MIN_TILE_INSTANCE_CAPACITY);
+		while (capacity < num_instances)
+			capacity *= 2;
+		capacity = std::min(capacity, max_tile_instances);
+
+		info.size = capacity * tile_size * tile_size * sizeof(uint32_t);
+		tile_instance_data.color[slot] = device->create_buffer(info);
+		info.size = capacity * tile_size * tile_size * sizeof(uint16_t);
+		tile_instance_data.depth[slot] = device->create_buffer(info);
+		info.size = capacity * tile_size * tile_size * sizeof(uint8_t);
+		tile_instance_data.flags[slot] = device->create_buffer(info);
+		tile_instance_data.capacity[slot] = capacity;
+	}
+
+	// Every tile instance is exactly one work item, and a slot rescaled to smaller tiles can hold more of them
+	// than the work lists were sized for. The work lists are only used on the binning queue,
+	// so in-flight batches keep the old buffers alive.
+	unsigned capacity = tile_instance_data.capacity[slot];
+	if (capacity > raster_work.work_list_capacity)
+	{
+		info.size = VkDeviceSize(capacity) * sizeof(TileRasterWork);
+		raster_work.work_list_unsorted = device->create_buffer(info);
+		raster_work.work_list = device->create_buffer(info);
+		raster_work.work_list_capacity = capacity;
+	}
+}
+
+void RasterizerGPU::Impl::resize_tile_grid()
+{
+	int width = int(std::max(color.width, depth.width));
+	int height = int(std::max(color.height, depth.height));
+	if (width > MAX_WIDTH || height > MAX_HEIGHT)
+		throw std::runtime_error("Framebuffer exceeds maximum resolution of 2048x2048.");
+
+	int tiles_x = std::max((width + tile_size - 1) / tile_size, 1);
+	int tiles_y = std::max((height + tile_size - 1) / tile_size, 1);
+
+	// With adaptive tile size, per-tile buffers are sized for the smaller tile size and shared by both.
+	int min_tile_size = adaptive_tile_size.enable ? SMALL_TILE_SIZE : tile_size;
+	unsigned min_tiles_x = std::max((width + min_tile_size - 1) / min_tile_size, 1);
+	unsigned min_tiles_y = std::max((height + min_tile_size - 1) / min_tile_size, 1);
+	unsigned capacity = min_tiles_x * min_tiles_y;
+	unsigned capacity_low_res = ((min_tiles_x + TILE_DOWNSAMPLE - 1) / TILE_DOWNSAMPLE) *
+	                            ((min_tiles_y + TILE_DOWNSAMPLE - 1) / TILE_DOWNSAMPLE);
+
+	if (tiles_x == max_tiles_x && tiles_y == max_tiles_y && capacity == tile_grid_capacity &&
+	    capacity_low_res == tile_grid_capacity_low_res)
+	{
+		return;
+	}
+
+	max_tiles_x = tiles_x;
+	max_tiles_y = tiles_y;
+	max_tiles_x_low_res = (tiles_x + TILE_DOWNSAMPLE - 1) / TILE_DOWNSAMPLE;
+	max_tiles_y_low_res = (tiles_y + TILE_DOWNSAMPLE - 1) / TILE_DOWNSAMPLE;
+
+	// Pending fast clears must have been resolved before the grid changes.
+	assert(fast_clear.num_pending_rows == 0);
+
+	// Switching tile size only changes the layout of per-tile state.
+	// The low-res grid can change shape under the same full-res capacity, e.g. 40x30 vs. 30x40 tiles.
+	if (capacity == tile_grid_capacity)
+	{
+		if (capacity_low_res != tile_grid_capacity_low_res)
+		{
+			tile_grid_capacity_low_res = capacity_low_res;
+			init_low_res_mask_buffer();
+		}
+		invalidate_hiz();
+		return;
+	}
+
+	tile_grid_capacity = capacity;
+	tile_grid_capacity_low_res = capacity_low_res;
+	max_tile_instances = std::max(max_primitives * TILE_INSTANCES_PER_PRIMITIVE, tile_grid_capacity);
+
+	// Per-batch buffers are recreated lazily. Batches in flight hold references to the old ones.
+	for (auto &mask : binning.mask_buffer)
+		mask.reset();
+	for (auto &mask : binning.mask_buffer_coarse)
+		mask.reset();
+	for (auto &offset : tile_count.tile_offset)
+		offset.reset();
+	for (auto &list : binning.touched_tiles)
+		list.reset();
+
+	init_binning_buffers();
+	init_fast_clear_buffers();
+	init_hiz_buffer();
+	invalidate_hiz();
+}
+
+int RasterizerGPU::Impl::select_tile_size()
+{
+	// With GPU triangle setup, the footprint of the batch is unknown on the CPU.
+	if (!adaptive_tile_size.enable || staging.count == 0 || !triangle_setup.jobs.empty())
+		return tile_size;
+
+	float instances_per_primitive = float(staging.num_conservative_tile_instances) / float(staging.count);
+	auto &average = adaptive_tile_size.instances_per_primitive;
+	if (average < 0.0f)
+		average = instances_per_primitive;
+	else
+		average += (instances_per_primitive - average) * ADAPTIVE_TILE_SIZE_RATE;
+
+	if (tile_size == SMALL_TILE_SIZE && average > LARGE_TILE_INSTANCES_PER_PRIMITIVE)
+		return LARGE_TILE_SIZE;
+	else if (tile_size == LARGE_TILE_SIZE && average < SMALL_TILE_INSTANCES_PER_PRIMITIVE)
+		return SMALL_TILE_SIZE;
+	else
+		return tile_size;
+}
+
+void RasterizerGPU::Impl::set_tile_size(int size)
+{
+	if (size == tile_size)
+		return;
+
+	// Fast clear metadata is laid out per tile, so pending clears are resolved on the old grid.
+	resolve_fast_clears();
+
+	// Rescale the average to the new tile size, assuming square bounding boxes.
+	auto &average = adaptive_tile_size.instances_per_primitive;
+	if (average >= 0.0f)
+	{
+		float extent = (std::sqrt(average) - 1.0f) * float(tile_size) / float(size) + 1.0f;
+		average = extent * extent;
+	}
+
+	tile_size = size;
+	tile_size_log2 = trailing_zeroes(tile_size);
+	resize_tile_grid();
+}
+
+void RasterizerGPU::Impl::init_fast_clear_buffers()
+{
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.size = tile_grid_capacity * sizeof(uint32_t);
+	info.misc = BUFFER_MISC_ZERO_INITIALIZE_BIT;
+	fast_clear.color = device->create_buffer(info);
+	fast_clear.depth = device->create_buffer(info);
+}
+
+void RasterizerGPU::Impl::init_hiz_buffer()
+{
+	// Filled by invalidate_hiz().
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.size = tile_grid_capacity * sizeof(uint32_t);
+	hiz.ranges = device->create_buffer(info);
+}
+
+void RasterizerGPU::Impl::advance_batch_slot()
+{
+	tile_instance_data.index = (tile_instance_data.index + 1) % tile_instance_data.num_slots;
 }
 
 void RasterizerGPU::Impl::init_raster_work_buffers()
@@ -985,11 +2102,11 @@ void RasterizerGPU::Impl::init_raster_work_buffers()
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 
-	// Round MAX_NUM_TILE_INSTANCES up to 0x10000.
-	info.size = (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork) * MAX_NUM_SHADER_STATE_INDICES;
-	raster_work.work_list_per_variant = device->create_buffer(info);
+	info.size = MAX_NUM_SHADER_STATE_INDICES * sizeof(uint32_t);
+	raster_work.work_list_offsets = device->create_buffer(info);
 
-	info.size = MAX_NUM_SHADER_STATE_INDICES * (4 * sizeof(uint32_t));
+	// One indirect dispatch per variant, plus one for scattering into the compacted work list.
+	info.size = (MAX_NUM_SHADER_STATE_INDICES + 1) * (4 * sizeof(uint32_t));
 	info.usage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
 	raster_work.item_count_per_variant = device->create_buffer(info);
 }
@@ -1022,19 +2139,33 @@ static std::vector<T> readback_buffer(Device *device, const Buffer &buffer)
 	return result;
 }
 
-void RasterizerGPU::Impl::init(Device &device_, bool subgroup_, bool ubershader_, bool async_compute_, unsigned tile_size_)
+void RasterizerGPU::Impl::init(Device &device_, bool subgroup_, bool ubershader_, bool async_compute_, unsigned tile_size_,
+                               unsigned max_primitives_, unsigned num_batches_in_flight_)
 {
+	if (num_batches_in_flight_ < MIN_NUM_BATCHES_IN_FLIGHT || num_batches_in_flight_ > MAX_NUM_BATCHES_IN_FLIGHT)
+		throw std::runtime_error("num_batches_in_flight must be in range [2, 4].");
+
+	// Coarse masks cover 1024 primitives per bit-word, so capacity must be a multiple of that.
+	if (max_primitives_ < MIN_MAX_PRIMITIVES || max_primitives_ > MAX_MAX_PRIMITIVES ||
+	    (max_primitives_ & (MIN_MAX_PRIMITIVES - 1)) != 0)
+	{
+		throw std::runtime_error("max_primitives must be a multiple of 1024 in range [1024, 262144].");
+	}
+
 	device = &device_;
 	subgroup = subgroup_;
 	ubershader = ubershader_;
 	async_compute = async_compute_;
 	tile_size = tile_size_;
+	adaptive_tile_size.fixed_tile_size = tile_size;
 
 	tile_size_log2 = trailing_zeroes(tile_size);
-	max_tiles_x = MAX_WIDTH / tile_size;
-	max_tiles_y = MAX_HEIGHT / tile_size;
-	max_tiles_x_low_res = MAX_WIDTH / (TILE_DOWNSAMPLE * tile_size);
-	max_tiles_y_low_res = MAX_HEIGHT / (TILE_DOWNSAMPLE * tile_size);
+
+	max_primitives = max_primitives_;
+	tile_binning_stride = max_primitives / 32;
+	tile_binning_stride_coarse = tile_binning_stride / 32;
+	max_tile_instances = max_primitives * TILE_INSTANCES_PER_PRIMITIVE;
+	tile_instance_data.num_slots = num_batches_in_flight_;
 
 	auto &features = device->get_device_features();
 	if (!features.storage_8bit_features.storageBuffer8BitAccess)
@@ -1044,10 +2175,10 @@ void RasterizerGPU::Impl::init(Device &device_, bool subgroup_, bool ubershader_
 	if (!features.ubo_std430_features.uniformBufferStandardLayout && !features.scalar_block_features.scalarBlockLayout)
 		throw std::runtime_error("UBO std430 storage not supported.");
 
-	init_binning_buffers();
-	init_prefix_sum_buffers();
-	init_tile_buffers();
+	init_staging_layout();
 	init_raster_work_buffers();
+	// Sized for the minimal grid until framebuffers are set.
+	resize_tile_grid();
 
 	BufferCreateInfo vram_info = {};
 	vram_info.domain = BufferDomain::Device;
@@ -1055,6 +2186,7 @@ void RasterizerGPU::Impl::init(Device &device_, bool subgroup_, bool ubershader_
 	vram_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	vram_info.misc = BUFFER_MISC_ZERO_INITIALIZE_BIT;
 	vram_buffer = device->create_buffer(vram_info);
+	vram_allocator.init(VRAM_SIZE);
 }
 
 RasterizerGPU::RasterizerGPU()
@@ -1071,13 +2203,161 @@ void RasterizerGPU::set_texture_descriptor(const TextureDescriptor &desc)
 	impl->state.current_render_state.tex = desc;
 }
 
+bool RasterizerGPU::Impl::evict_texture()
+{
+	// Textures set in the current frame or in the open batch might still be sampled by it.
+	TextureResource *victim = nullptr;
+	for (auto &texture : textures)
+		if (texture.resident && texture.last_used_frame < frame_index && texture.last_used_batch != state.batch_id &&
+		    (!victim || texture.last_used_frame < victim->last_used_frame))
+			victim = &texture;
+
+	if (!victim)
+		return false;
+
+	vram_allocator.free(victim->levels[0].vram_offset);
+	victim->resident = false;
+	return true;
+}
+
+bool RasterizerGPU::Impl::allocate_vram(uint32_t size, uint32_t alignment, uint32_t &offset)
+{
+	while (!vram_allocator.allocate(size, alignment, offset))
+		if (!evict_texture())
+			return false;
+	return true;
+}
+
+bool RasterizerGPU::Impl::make_texture_resident(TextureResource &texture)
+{
+	uint32_t offset;
+	if (!allocate_vram(texture.vram_size, TEXTURE_VRAM_ALIGNMENT, offset))
+		return false;
+
+	for (unsigned level = 0; level < texture.num_levels; level++)
+	{
+		auto &l = texture.levels[level];
+		uint32_t blocks_width, blocks_height;
+		compute_texture_blocks(texture.fmt, l.width, l.height, blocks_width, blocks_height);
+
+		l.vram_offset = offset;
+		texture.desc.texture_offset[level] = offset;
+		queue_texture_upload(offset, texture.data.data() + l.data_offset, l.width, l.height, texture.fmt);
+		offset += blocks_width * blocks_height * 64 * sizeof(uint16_t);
+	}
+
+	if (!texture.palette.empty())
+	{
+		texture.desc.texture_offset[TEXTURE_PALETTE_LEVEL] = offset;
+		queue_palette_upload(offset, texture.palette.data(), unsigned(texture.palette.size()));
+	}
+
+	texture.resident = true;
+	return true;
+}
+
+bool RasterizerGPU::allocate_vram(uint32_t size, uint32_t alignment, uint32_t &offset)
+{
+	return impl->allocate_vram(size, alignment, offset);
+}
+
+void RasterizerGPU::free_vram(uint32_t offset)
+{
+	impl->vram_allocator.free(offset);
+}
+
+TextureHandle RasterizerGPU::create_texture(const TextureDescriptor &desc, const TextureLevel *levels, unsigned num_levels)
+{
+	Impl::TextureResource texture = {};
+	texture.desc = desc;
+	texture.fmt = TextureFormatBits(desc.texture_fmt & ~(TEXTURE_FMT_FILTER_MIP_LINEAR_BIT | TEXTURE_FMT_FILTER_LINEAR_BIT));
+	texture.num_levels = std::min(num_levels, MAX_TEXTURE_LEVELS);
+
+	unsigned palette_size = get_palette_size(texture.fmt);
+	bool vq = texture.fmt == TEXTURE_FMT_VQ;
+	PaletteQuantizer quantizer;
+	VectorQuantizer vector_quantizer;
+	if (palette_size)
+	{
+		texture.num_levels = std::min(texture.num_levels, TEXTURE_PALETTE_LEVEL);
+		texture.desc.texture_max_lod = int8_t(std::min<int>(desc.texture_max_lod, texture.num_levels - 1));
+		if (vq)
+		{
+			for (unsigned level = 0; level < texture.num_levels; level++)
+				vector_quantizer.add_image(levels[level].data, levels[level].width, levels[level].height);
+			vector_quantizer.build_codebook();
+			texture.palette = vector_quantizer.get_codebook();
+		}
+		else
+		{
+			for (unsigned level = 0; level < texture.num_levels; level++)
+				quantizer.add_pixels(levels[level].data, levels[level].width * levels[level].height);
+			quantizer.build_palette(palette_size);
+			texture.palette = quantizer.get_palette();
+		}
+		texture.vram_size += get_palette_vram_size(texture.fmt);
+	}
+
+	for (unsigned level = 0; level < texture.num_levels; level++)
+	{
+		uint32_t blocks_width, blocks_height;
+		if (!compute_texture_blocks(texture.fmt, levels[level].width, levels[level].height, blocks_width, blocks_height))
+			return {};
+
+		auto &l = texture.levels[level];
+		l.data_offset = texture.data.size();
+		l.width = levels[level].width;
+		l.height = levels[level].height;
+		if (vq)
+		{
+			texture.data.resize(l.data_offset + ((l.width + 1) / 2) * ((l.height + 1) / 2));
+			vector_quantizer.encode_image(levels[level].data, l.width, l.height, texture.data.data() + l.data_offset);
+		}
+		else if (palette_size)
+		{
+			for (unsigned i = 0; i < l.width * l.height; i++)
+				texture.data.push_back(quantizer.get_index(levels[level].data[i]));
+		}
+		else
+			texture.data.insert(texture.data.end(), levels[level].data, levels[level].data + l.width * l.height);
+		texture.vram_size += blocks_width * blocks_height * 64 * sizeof(uint16_t);
+	}
+
+	TextureHandle handle = { uint32_t(impl->textures.size()) };
+	impl->textures.push_back(std::move(texture));
+	return handle;
+}
+
+bool RasterizerGPU::set_texture(TextureHandle handle)
+{
+	if (handle.index >= impl->textures.size())
+		return false;
+
+	auto &texture = impl->textures[handle.index];
+	if (!texture.resident && !impl->make_texture_resident(texture))
+		return false;
+
+	texture.last_used_frame = impl->frame_index;
+	texture.last_used_batch = impl->state.batch_id;
+	set_texture_descriptor(texture.desc);
+	return true;
+}
+
+void RasterizerGPU::next_frame()
+{
+	impl->frame_index++;
+}
+
 void RasterizerGPU::set_color_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride)
 {
 	flush();
+	// Pending clears are tied to the current framebuffer layout.
+	impl->resolve_fast_clears();
 	impl->color.offset = offset;
 	impl->color.width = width;
 	impl->color.height = height;
 	impl->color.stride = stride;
+	impl->resize_tile_grid();
 
 	impl->state.current_render_state.scissor_x = 0;
 	impl->state.current_render_state.scissor_y = 0;
@@ -1088,138 +2368,292 @@ void RasterizerGPU::set_color_framebuffer(unsigned offset, unsigned width, unsig
 void RasterizerGPU::set_depth_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride)
 {
 	flush();
+	impl->resolve_fast_clears();
 	impl->depth.offset = offset;
 	impl->depth.width = width;
 	impl->depth.height = height;
 	impl->depth.stride = stride;
+	impl->resize_tile_grid();
+	impl->invalidate_hiz();
 }
 
 void RasterizerGPU::clear_depth(uint16_t z)
 {
 	flush();
-	auto cmd = impl->device->request_command_buffer();
-	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT);
-	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	cmd->set_storage_buffer(0, 0, *impl->vram_buffer);
-	cmd->set_program("assets://shaders/clear_framebuffer.comp",
-	                 {{ "TILE_SIZE", impl->tile_size }});
+	impl->depth.clear_value = z;
+	impl->fast_clear_framebuffer(*impl->fast_clear.depth, impl->depth, "clear-depth");
 
-	struct Registers
-	{
-		uint32_t offset;
-		uint32_t width;
-		uint32_t height;
-		uint32_t stride;
-		uint32_t value;
-	} registers;
+	// Tiles reaching outside the depth buffer test against undefined depth there, see rop.comp.
+	if (impl->depth.width >= impl->color.width && impl->depth.height >= impl->color.height)
+		impl->invalidate_hiz(uint32_t(z) | (uint32_t(z) << 16));
+	else
+		impl->invalidate_hiz();
+}
 
-	registers.offset = impl->depth.offset >> 1;
-	registers.width = impl->depth.width;
-	registers.height = impl->depth.height;
-	registers.stride = impl->depth.stride >> 1;
-	registers.value = z;
-	cmd->push_constants(&registers, 0, sizeof(registers));
+void RasterizerGPU::copy_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt)
+{
+	queue_texture_rgba8888_to_vram(offset, src, width, height, fmt);
+	impl->submit_texture_uploads();
+}
 
-	cmd->dispatch((registers.width + 15) / 16, (registers.height + 15) / 16, 1);
+void RasterizerGPU::queue_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt)
+{
+	// Rendering queued so far must observe the VRAM contents from before the upload.
+	impl->flush_primitives();
+	impl->queue_texture_upload(offset, src, width, height, fmt);
+}
 
-	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	impl->device->register_time_interval(t0, t1, "clear-depth");
-	impl->device->submit(cmd);
+void RasterizerGPU::copy_texture_rgba8888_to_vram(uint32_t offset, uint32_t palette_offset, const uint32_t *src,
+                                                  unsigned width, unsigned height, TextureFormatBits fmt)
+{
+	queue_texture_rgba8888_to_vram(offset, palette_offset, src, width, height, fmt);
+	impl->submit_texture_uploads();
 }
 
-void RasterizerGPU::copy_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt)
+void RasterizerGPU::queue_texture_rgba8888_to_vram(uint32_t offset, uint32_t palette_offset, const uint32_t *src,
+                                                   unsigned width, unsigned height, TextureFormatBits fmt)
 {
-	flush();
+	impl->flush_primitives();
+	impl->queue_quantized_texture_upload(offset, palette_offset, src, width, height, fmt);
+}
 
-	struct Registers
-	{
-		uint32_t offset;
-		uint32_t blocks_width;
-		uint32_t blocks_height;
-		uint32_t width;
-		uint32_t height;
-	} registers;
+void RasterizerGPU::Impl::queue_quantized_texture_upload(uint32_t offset, uint32_t palette_offset, const uint32_t *src,
+                                                         unsigned width, unsigned height, TextureFormatBits fmt)
+{
+	unsigned palette_size = get_palette_size(fmt);
+	if (!palette_size)
+		return;
 
-	switch (fmt)
+	if (fmt == TEXTURE_FMT_VQ)
 	{
-	case TEXTURE_FMT_ARGB1555:
-	case TEXTURE_FMT_LA88:
-		registers.blocks_width = (width + 7) / 8;
-		break;
+		VectorQuantizer quantizer;
+		quantizer.add_image(src, width, height);
+		quantizer.build_codebook();
 
-	case TEXTURE_FMT_I8:
-		registers.blocks_width = (width + 15) / 16;
-		break;
+		std::vector<uint32_t> indices(((width + 1) / 2) * ((height + 1) / 2));
+		quantizer.encode_image(src, width, height, indices.data());
 
-	default:
+		queue_texture_upload(offset, indices.data(), width, height, fmt);
+		queue_palette_upload(palette_offset, quantizer.get_codebook().data(), palette_size);
 		return;
 	}
 
-	BufferCreateInfo info = {};
-	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-	info.domain = BufferDomain::Host;
-	info.size = width * height * sizeof(uint32_t);
+	PaletteQuantizer quantizer;
+	quantizer.add_pixels(src, width * height);
+	quantizer.build_palette(palette_size);
 
-	auto buffer = impl->device->create_buffer(info, src);
-	auto cmd = impl->device->request_command_buffer();
+	std::vector<uint32_t> indices(width * height);
+	for (unsigned i = 0; i < width * height; i++)
+		indices[i] = quantizer.get_index(src[i]);
 
-	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT);
+	queue_texture_upload(offset, indices.data(), width, height, fmt);
+	queue_palette_upload(palette_offset, quantizer.get_palette().data(), palette_size);
+}
+
+void RasterizerGPU::Impl::queue_palette_upload(uint32_t offset, const uint32_t *palette, unsigned num_colors)
+{
+	// An ARGB1555 texture 8 texels wide has one 8x8 block per 8 rows, so its texels are laid out linearly.
+	queue_texture_upload(offset, palette, 8, num_colors / 8, TEXTURE_FMT_ARGB1555);
+}
 
-	cmd->set_storage_buffer(0, 0, *impl->vram_buffer);
-	cmd->set_storage_buffer(0, 1, *buffer);
-	cmd->set_program("assets://shaders/copy_framebuffer.comp",
-	                 {{ "TILE_SIZE", impl->tile_size }, { "FMT", int(fmt) }});
+Fence RasterizerGPU::submit_texture_uploads()
+{
+	return impl->submit_texture_uploads();
+}
 
-	registers.offset = offset >> 1;
-	registers.blocks_height = (height + 7) / 8;
+void RasterizerGPU::Impl::queue_texture_upload(uint32_t offset, const uint32_t *src, unsigned width, unsigned height,
+                                               TextureFormatBits fmt)
+{
+	// A VQ index map is laid out like a PAL8 texture of half the size.
+	if (fmt == TEXTURE_FMT_VQ)
+	{
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		fmt = TEXTURE_FMT_PAL8;
+	}
 
-	registers.width = width;
-	registers.height = height;
-	cmd->push_constants(&registers, 0, sizeof(registers));
-	cmd->dispatch(registers.blocks_width, registers.blocks_height, 1);
-	impl->device->submit(cmd);
+	TextureUpload upload = {};
+	if (!compute_texture_blocks(fmt, width, height, upload.blocks_width, upload.blocks_height))
+		return;
+
+	// The shader writes whole blocks of 64 halfwords. An upload into the depth buffer changes it behind Hi-Z.
+	uint64_t vram_end = uint64_t(offset) +
+	                    uint64_t(upload.blocks_width) * upload.blocks_height * 64 * sizeof(uint16_t);
+	uint64_t depth_end = uint64_t(depth.offset) + uint64_t(depth.stride) * depth.height;
+	if (offset < depth_end && vram_end > depth.offset)
+		invalidate_hiz();
+
+	upload.vram_offset = offset >> 1;
+	upload.width = width;
+	upload.height = height;
+	upload.fmt = fmt;
+	upload.size = VkDeviceSize(width) * height * sizeof(uint32_t);
+
+	VkDeviceSize alignment = std::max<VkDeviceSize>(device->get_gpu_properties().limits.minStorageBufferOffsetAlignment, 16);
+	VkDeviceSize aligned_size = (upload.size + alignment - 1) & ~(alignment - 1);
+	VkDeviceSize capacity = texture_upload.arena ? texture_upload.arena->get_create_info().size : 0;
+
+	// Arena is full, kick what we have so far.
+	if (!texture_upload.uploads.empty() && texture_upload.offset + aligned_size > capacity)
+		submit_texture_uploads();
+
+	if (!texture_upload.mapped)
+	{
+		if (texture_upload.fence)
+		{
+			texture_upload.fence->wait();
+			texture_upload.fence.reset();
+		}
+
+		if (aligned_size > capacity)
+		{
+			BufferCreateInfo info;
+			info.domain = BufferDomain::Host;
+			info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+			info.size = std::max(aligned_size, TEXTURE_UPLOAD_ARENA_SIZE);
+			texture_upload.arena = device->create_buffer(info);
+		}
+
+		texture_upload.mapped = static_cast<uint8_t *>(device->map_host_buffer(*texture_upload.arena, MEMORY_ACCESS_WRITE_BIT));
+		texture_upload.offset = 0;
+	}
+
+	upload.arena_offset = texture_upload.offset;
+	memcpy(texture_upload.mapped + upload.arena_offset, src, upload.size);
+	texture_upload.offset += aligned_size;
+	texture_upload.uploads.push_back(upload);
 }
 
-void RasterizerGPU::clear_color(uint32_t rgba)
+Fence RasterizerGPU::Impl::submit_texture_uploads()
 {
-	flush();
-	auto cmd = impl->device->request_command_buffer();
+	if (texture_upload.uploads.empty())
+		return texture_upload.fence;
+
+	device->unmap_host_buffer(*texture_upload.arena, MEMORY_ACCESS_WRITE_BIT);
+	texture_upload.mapped = nullptr;
+
+	// The upload might alias a framebuffer with a pending clear.
+	resolve_fast_clears();
+
+	// Swizzling needs compute, so this cannot go on a transfer queue. Uploads may overwrite memory of evicted
+	// textures, so they must be ordered after any earlier work which samples textures. With the split
+	// pipeline on async compute that is the combiner on the async queue, otherwise everything is on the
+	// generic queue.
+	auto queue_type = async_compute && !ubershader ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic;
+
+	// ROP, clear resolves and scanout access VRAM on the generic queue, so uploads on the async queue must
+	// wait for those as well. This includes the clear resolve above.
+	if (queue_type == CommandBuffer::Type::AsyncCompute && generic_since_upload)
+	{
+		auto generic_cmd = device->request_command_buffer(CommandBuffer::Type::Generic);
+		Semaphore sem;
+		device->submit(generic_cmd, nullptr, 1, &sem);
+		device->add_wait_semaphore(CommandBuffer::Type::AsyncCompute, sem, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
+	}
+	generic_since_upload = false;
+
+	auto cmd = device->request_command_buffer(queue_type);
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	             VK_ACCESS_SHADER_WRITE_BIT);
 	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	cmd->set_storage_buffer(0, 0, *impl->vram_buffer);
-	cmd->set_program("assets://shaders/clear_framebuffer.comp",
-	                 {{ "TILE_SIZE", impl->tile_size }});
+	cmd->set_storage_buffer(0, 0, *vram_buffer);
 
 	struct Registers
 	{
 		uint32_t offset;
+		uint32_t blocks_width;
+		uint32_t blocks_height;
 		uint32_t width;
 		uint32_t height;
-		uint32_t stride;
-		uint32_t value;
-	} registers;
+	};
 
-	registers.offset = impl->color.offset >> 1;
-	registers.width = impl->color.width;
-	registers.height = impl->color.height;
-	registers.stride = impl->color.stride >> 1;
-	registers.value = rgba;
-	cmd->push_constants(&registers, 0, sizeof(registers));
+	for (auto &upload : texture_upload.uploads)
+	{
+		cmd->set_storage_buffer(0, 1, *texture_upload.arena, upload.arena_offset, upload.size);
+		cmd->set_program("assets://shaders/copy_framebuffer.comp",
+		                 {{ "TILE_SIZE", tile_size }, { "FMT", int(upload.fmt) }});
+
+		Registers registers = {
+			upload.vram_offset, upload.blocks_width, upload.blocks_height, upload.width, upload.height,
+		};
+		cmd->push_constants(&registers, 0, sizeof(registers));
+		cmd->dispatch(registers.blocks_width, registers.blocks_height, 1);
+	}
+
+	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	register_stage_time(t0, t1, RasterizerStage::TextureUpload, "texture-upload");
+
+	// Rendering consumes VRAM on the generic queue, and on the async compute queue for the split pipeline.
+	Semaphore sems[2];
+	unsigned num_sems = async_compute ? 2 : 1;
+	device->submit(cmd, &texture_upload.fence, num_sems, sems);
+	device->add_wait_semaphore(CommandBuffer::Type::Generic, sems[0], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
+	if (async_compute)
+		device->add_wait_semaphore(CommandBuffer::Type::AsyncCompute, sems[1], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
+
+	texture_upload.uploads.clear();
+	return texture_upload.fence;
+}
+
+void RasterizerGPU::clear_color(uint32_t rgba)
+{
+	flush();
+	// VRAM is 16-bit, the value is expected to be packed already.
+	impl->color.clear_value = rgba & 0xffffu;
+	impl->fast_clear_framebuffer(*impl->fast_clear.color, impl->color, "clear-color");
+}
 
-	cmd->dispatch((registers.width + 15) / 16, (registers.height + 15) / 16, 1);
+void RasterizerGPU::Impl::fast_clear_framebuffer(const Buffer &metadata, const Framebuffer &fb, const char *tag)
+{
+	// Metadata is filled for whole rows of tiles, so the resolve pass knows which rows to visit.
+	unsigned num_rows = (fb.height + tile_size - 1) / tile_size;
+	if (num_rows == 0)
+		return;
 
+	auto cmd = device->request_command_buffer();
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT,
+	             VK_ACCESS_TRANSFER_WRITE_BIT);
+	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	cmd->fill_buffer(metadata, 1, 0, num_rows * max_tiles_x * sizeof(uint32_t));
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	impl->device->register_time_interval(t0, t1, "clear-color");
-	impl->device->submit(cmd);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT,
+	             VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	register_stage_time(t0, t1, RasterizerStage::Clear, tag);
+	device->submit(cmd);
+
+	fast_clear.num_pending_rows = std::max(fast_clear.num_pending_rows, num_rows);
+}
+
+void RasterizerGPU::Impl::resolve_fast_clears()
+{
+	if (fast_clear.num_pending_rows == 0)
+		return;
+
+	auto cmd = device->request_command_buffer();
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	set_fb_info(*cmd);
+	cmd->set_storage_buffer(0, 0, *vram_buffer);
+	cmd->set_storage_buffer(0, 1, *fast_clear.color);
+	cmd->set_storage_buffer(0, 2, *fast_clear.depth);
+	cmd->set_program("assets://shaders/clear_framebuffer.comp",
+	                 {{ "TILE_SIZE", tile_size }});
+	cmd->dispatch(max_tiles_x, fast_clear.num_pending_rows, 1);
+	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	register_stage_time(t0, t1, RasterizerStage::ClearResolve, "resolve-clear");
+	device->submit(cmd);
+	generic_since_upload = true;
+
+	fast_clear.num_pending_rows = 0;
 }
 
 void RasterizerGPU::set_depth_state(DepthTest mode, DepthWrite write)
@@ -1242,59 +2676,235 @@ void RasterizerGPU::set_scissor(int x, int y, int width, int height)
 
 void RasterizerGPU::Impl::queue_primitive(const PrimitiveSetup &setup)
 {
-	unsigned num_conservative_tiles = ubershader ? 0 : compute_num_conservative_tiles(setup);
+	// Primitives which are completely scissored out can be dropped here.
+	PrimitiveSetupBBox clipped_bbox;
+	if (!clip_bbox_scissor(clipped_bbox, setup.bbox, state.current_render_state))
+		return;
+
+	unsigned num_conservative_tiles = ubershader ? 0 : compute_num_conservative_tiles(clipped_bbox);
 
 	state.current_shader_state = compute_shader_state();
-	bool shader_state_changed = state.shader_state_count != 0 &&
-	                            state.current_shader_state != state.shader_states[state.shader_state_count - 1];
+	Util::Hash shader_state_hash = hash_shader_state(state.current_shader_state);
+	int shader_state_index = find_shader_state(state.current_shader_state, shader_state_hash);
 
-	bool render_state_changed = memcmp(&state.current_render_state, &state.last_render_state, sizeof(RenderState)) != 0;
+	Util::Hash render_state_hash = 0;
+	int render_state_index = -1;
+
+	// Fast path, consecutive primitives tend to share state, so avoid hashing.
+	if (state.render_state_count != 0 &&
+	    memcmp(&state.current_render_state, &state.render_states[state.last_render_state_index], sizeof(RenderState)) == 0)
+	{
+		render_state_index = int(state.last_render_state_index);
+	}
+	else
+	{
+		render_state_hash = hash_render_state(state.current_render_state);
+		render_state_index = find_render_state(state.current_render_state, render_state_hash);
+	}
 
 	bool need_flush = false;
-	if (staging.count == MAX_PRIMITIVES)
+	if (staging.count == max_primitives)
 		need_flush = true;
-	else if (staging.num_conservative_tile_instances + num_conservative_tiles > MAX_NUM_TILE_INSTANCES)
+	else if (staging.num_conservative_tile_instances + num_conservative_tiles > max_tile_instances)
 		need_flush = true;
-	else if (shader_state_changed && state.shader_state_count == MAX_NUM_SHADER_STATE_INDICES)
+	else if (shader_state_index < 0 && state.shader_state_count == MAX_NUM_SHADER_STATE_INDICES)
 		need_flush = true;
-	else if (render_state_changed && state.render_state_count == MAX_NUM_RENDER_STATE_INDICES)
+	else if (render_state_index < 0 && state.render_state_count == MAX_NUM_RENDER_STATE_INDICES)
 		need_flush = true;
 
 	if (need_flush)
+	{
 		flush();
+		shader_state_index = -1;
+		if (render_state_index >= 0)
+			render_state_hash = hash_render_state(state.current_render_state);
+		render_state_index = -1;
+	}
 
-	if (staging.count == 0)
+	if (!staging.mapped_positions)
 		begin_staging();
 
-	unsigned current_shader_state;
-	unsigned current_render_state;
+	if (shader_state_index < 0)
+		shader_state_index = int(insert_shader_state(state.current_shader_state, shader_state_hash));
+	if (render_state_index < 0)
+		render_state_index = int(insert_render_state(state.current_render_state, render_state_hash));
 
-	if (state.shader_state_count == 0 || shader_state_changed)
+	state.last_render_state_index = unsigned(render_state_index);
+
+	staging.mapped_positions[staging.count] = setup.pos;
+	staging.mapped_attributes[staging.count] = setup.attr;
+	staging.mapped_bboxes[staging.count] = clipped_bbox;
+	staging.mapped_shader_state_index[staging.count] = uint8_t(shader_state_index);
+	staging.mapped_render_state_index[staging.count] = uint16_t(render_state_index);
+
+	staging.count++;
+	staging.num_conservative_tile_instances += num_conservative_tiles;
+}
+
+bool RasterizerGPU::Impl::bind_state_block(StateBlock &block)
+{
+	if (block.batch_id == state.batch_id)
+		return true;
+
+	int shader_state_index = find_shader_state(block.shader_state, block.shader_state_hash);
+	int render_state_index = find_render_state(block.render_state, block.render_state_hash);
+
+	if (shader_state_index < 0 && state.shader_state_count == MAX_NUM_SHADER_STATE_INDICES)
+		return false;
+	if (render_state_index < 0 && state.render_state_count == MAX_NUM_RENDER_STATE_INDICES)
+		return false;
+
+	if (shader_state_index < 0)
+		shader_state_index = int(insert_shader_state(block.shader_state, block.shader_state_hash));
+	if (render_state_index < 0)
+		render_state_index = int(insert_render_state(block.render_state, block.render_state_hash));
+
+	block.shader_state_index = uint8_t(shader_state_index);
+	block.render_state_index = uint16_t(render_state_index);
+	block.batch_id = state.batch_id;
+	return true;
+}
+
+bool RasterizerGPU::Impl::reserve_primitives(PrimitiveReservation &reservation, StateBlock &block,
+                                             const unsigned *num_conservative_tiles, unsigned count)
+{
+	if (!staging.mapped_positions)
+		begin_staging();
+
+	if (!bind_state_block(block))
+		return false;
+
+	unsigned capacity = max_primitives - staging.count;
+	unsigned reserved = 0;
+	unsigned reserved_tiles = 0;
+	while (reserved < count && reserved < capacity)
 	{
-		state.shader_states[state.shader_state_count] = state.current_shader_state;
-		current_shader_state = state.shader_state_count;
-		state.shader_state_count++;
+		unsigned num_tiles = num_conservative_tiles[reserved];
+		// A single primitive always fits in an empty batch.
+		if (staging.num_conservative_tile_instances + reserved_tiles + num_tiles > max_tile_instances &&
+		    staging.count + reserved != 0)
+		{
+			break;
+		}
+
+		reserved_tiles += num_tiles;
+		reserved++;
 	}
-	else
-		current_shader_state = state.shader_state_count - 1;
 
-	if (state.render_state_count == 0 || render_state_changed)
+	if (reserved == 0)
+		return false;
+
+	reservation.offset = staging.count;
+	reservation.count = reserved;
+	reservation.shader_state_index = block.shader_state_index;
+	reservation.render_state_index = block.render_state_index;
+
+	staging.count += reserved;
+	staging.num_conservative_tile_instances += reserved_tiles;
+	active_writers++;
+	return true;
+}
+
+void RasterizerGPU::Impl::queue_primitives(uint32_t block_index, const PrimitiveSetup *setup, size_t count)
+{
+	PrimitiveSetupBBox clipped_bboxes[SUBMISSION_CHUNK_SIZE];
+	unsigned num_conservative_tiles[SUBMISSION_CHUNK_SIZE];
+	size_t source_indices[SUBMISSION_CHUNK_SIZE];
+
+	// state_blocks may be reallocated by another thread, so take a copy of the immutable render state.
+	std::unique_lock<std::mutex> holder{submission_lock};
+	assert(block_index < state_blocks.size());
+	const RenderState render_state = state_blocks[block_index].render_state;
+	holder.unlock();
+
+	size_t i = 0;
+	while (i < count)
 	{
-		staging.mapped_render_state[state.render_state_count] = state.current_render_state;
-		state.last_render_state = state.current_render_state;
-		current_render_state = state.render_state_count;
-		state.render_state_count++;
+		// Culling and tile counting is done before taking the lock.
+		unsigned num_visible = 0;
+		for (; i < count && num_visible < SUBMISSION_CHUNK_SIZE; i++)
+		{
+			if (!clip_bbox_scissor(clipped_bboxes[num_visible], setup[i].bbox, render_state))
+				continue;
+
+			num_conservative_tiles[num_visible] =
+					ubershader ? 0 : compute_num_conservative_tiles(clipped_bboxes[num_visible]);
+			source_indices[num_visible] = i;
+			num_visible++;
+		}
+
+		unsigned written = 0;
+		while (written < num_visible)
+		{
+			PrimitiveReservation reservation;
+			holder.lock();
+			while (!reserve_primitives(reservation, state_blocks[block_index],
+			                           num_conservative_tiles + written, num_visible - written))
+			{
+				// Batch is full. Writes from other threads must land before it can be flushed,
+				// and one of them may flush it for us in the meantime, so retry after waiting.
+				if (active_writers != 0)
+					submission_idle.wait(holder, [this]() { return active_writers == 0; });
+				else
+					flush();
+			}
+			holder.unlock();
+
+			// The staging mappings cannot change while we hold a reservation.
+			for (unsigned j = 0; j < reservation.count; j++)
+			{
+				const auto &src = setup[source_indices[written + j]];
+				unsigned dst = reservation.offset + j;
+				staging.mapped_positions[dst] = src.pos;
+				staging.mapped_attributes[dst] = src.attr;
+				staging.mapped_bboxes[dst] = clipped_bboxes[written + j];
+			}
+
+			memset(staging.mapped_shader_state_index + reservation.offset,
+			       reservation.shader_state_index, reservation.count);
+			std::fill(staging.mapped_render_state_index + reservation.offset,
+			          staging.mapped_render_state_index + reservation.offset + reservation.count,
+			          reservation.render_state_index);
+
+			written += reservation.count;
+
+			holder.lock();
+			if (--active_writers == 0)
+				submission_idle.notify_all();
+			holder.unlock();
+		}
 	}
-	else
-		current_render_state = state.render_state_count - 1;
+}
 
-	staging.mapped_positions[staging.count] = setup.pos;
-	staging.mapped_attributes[staging.count] = setup.attr;
-	staging.mapped_shader_state_index[staging.count] = current_shader_state;
-	staging.mapped_render_state_index[staging.count] = current_render_state;
+RenderStateBlock RasterizerGPU::Impl::create_render_state_block()
+{
+	StateBlock block = {};
+	block.render_state = state.current_render_state;
+	block.shader_state = compute_shader_state();
+	block.render_state_hash = hash_render_state(block.render_state);
+	block.shader_state_hash = hash_shader_state(block.shader_state);
+	block.batch_id = ~uint64_t(0);
+
+	Util::Hasher h;
+	h.u64(block.render_state_hash);
+	h.u64(block.shader_state_hash);
+
+	auto itr = state_block_lookup.find(h.get());
+	if (itr != state_block_lookup.end())
+	{
+		auto &existing = state_blocks[itr->second];
+		if (existing.shader_state == block.shader_state &&
+		    memcmp(&existing.render_state, &block.render_state, sizeof(RenderState)) == 0)
+		{
+			return { itr->second };
+		}
+	}
 
-	staging.count++;
-	staging.num_conservative_tile_instances += num_conservative_tiles;
+	RenderStateBlock handle = { uint32_t(state_blocks.size()) };
+	state_blocks.push_back(block);
+	// On a hash collision the new block is simply not deduplicated.
+	state_block_lookup.emplace(h.get(), handle.index);
+	return handle;
 }
 
 void RasterizerGPU::rasterize_primitives(const RetroWarp::PrimitiveSetup *setup, size_t count)
@@ -1303,24 +2913,265 @@ void RasterizerGPU::rasterize_primitives(const RetroWarp::PrimitiveSetup *setup,
 		impl->queue_primitive(setup[i]);
 }
 
+uint32_t RasterizerGPU::Impl::queue_triangle_vertices(const TriangleVertexSource &source)
+{
+	if (source.vertices)
+	{
+		auto offset = uint32_t(triangle_setup.vertices.size());
+		triangle_setup.vertices.insert(triangle_setup.vertices.end(), source.vertices, source.vertices + source.num_vertices);
+		return offset;
+	}
+
+	auto &transform = *source.transform;
+	VertexTransformGPU gpu_transform = {};
+	memcpy(gpu_transform.mvp, &transform.mvp, sizeof(gpu_transform.mvp));
+	for (unsigned col = 0; col < 3; col++)
+	{
+		gpu_transform.normal_matrix[4 * col + 0] = transform.normal_matrix[col].x;
+		gpu_transform.normal_matrix[4 * col + 1] = transform.normal_matrix[col].y;
+		gpu_transform.normal_matrix[4 * col + 2] = transform.normal_matrix[col].z;
+	}
+	gpu_transform.light_direction[0] = transform.light_direction.x;
+	gpu_transform.light_direction[1] = transform.light_direction.y;
+	gpu_transform.light_direction[2] = transform.light_direction.z;
+	gpu_transform.diffuse = transform.diffuse;
+	gpu_transform.ambient = transform.ambient;
+
+	VertexTransformJob job;
+	job.vertices = static_vertex_buffers[source.vertex_buffer];
+	job.num_vertices = source.num_vertices;
+	job.transform_index = uint32_t(triangle_setup.transforms.size());
+	job.output_offset = triangle_setup.num_transformed_vertices;
+	triangle_setup.transforms.push_back(gpu_transform);
+	triangle_setup.transform_jobs.push_back(job);
+	triangle_setup.num_transformed_vertices += source.num_vertices;
+	return job.output_offset;
+}
+
+void RasterizerGPU::Impl::queue_triangles(const TriangleVertexSource &source, const uint32_t *indices,
+                                          unsigned num_triangles, CullMode mode, const ViewportTransform &vp)
+{
+	StateBlock block = {};
+	block.render_state = state.current_render_state;
+	block.shader_state = compute_shader_state();
+	block.render_state_hash = hash_render_state(block.render_state);
+	block.shader_state_hash = hash_shader_state(block.shader_state);
+	block.batch_id = ~uint64_t(0);
+
+	uint64_t vertex_batch_id = ~uint64_t(0);
+	uint32_t vertex_offset = 0;
+
+	unsigned first = 0;
+	while (first < num_triangles)
+	{
+		if (!staging.mapped_positions)
+			begin_staging();
+
+		unsigned capacity = (max_primitives - staging.count) / MAX_CLIPPED_PRIMITIVES;
+
+		if (capacity == 0 || !bind_state_block(block))
+		{
+			flush();
+			continue;
+		}
+
+		// Vertices are uploaded or transformed once for every batch the triangles end up in.
+		if (vertex_batch_id != state.batch_id)
+		{
+			vertex_offset = queue_triangle_vertices(source);
+			vertex_batch_id = state.batch_id;
+		}
+
+		unsigned count = std::min(num_triangles - first, capacity);
+
+		TriangleSetupJob job;
+		job.transformed = source.vertices == nullptr;
+		job.vertex_offset = vertex_offset;
+		job.index_offset = uint32_t(triangle_setup.indices.size());
+		job.num_triangles = count;
+		job.primitive_offset = staging.count;
+		job.cull_mode = mode;
+		job.viewport = vp;
+		job.scissor[0] = block.render_state.scissor_x;
+		job.scissor[1] = block.render_state.scissor_y;
+		job.scissor[2] = block.render_state.scissor_width;
+		job.scissor[3] = block.render_state.scissor_height;
+		triangle_setup.jobs.push_back(job);
+		triangle_setup.indices.insert(triangle_setup.indices.end(), indices + 3 * first, indices + 3 * (first + count));
+
+		// Positions, attributes and bounding boxes are written by the GPU.
+		unsigned num_slots = count * MAX_CLIPPED_PRIMITIVES;
+		memset(staging.mapped_shader_state_index + staging.count, block.shader_state_index, num_slots);
+		std::fill(staging.mapped_render_state_index + staging.count,
+		          staging.mapped_render_state_index + staging.count + num_slots,
+		          block.render_state_index);
+
+		staging.count += num_slots;
+		first += count;
+	}
+}
+
+void RasterizerGPU::rasterize_triangles(const Vertex *vertices, unsigned num_vertices, const uint32_t *indices,
+                                       unsigned num_triangles, CullMode mode, const ViewportTransform &vp)
+{
+	Impl::TriangleVertexSource source = {};
+	source.vertices = vertices;
+	source.num_vertices = num_vertices;
+	impl->queue_triangles(source, indices, num_triangles, mode, vp);
+}
+
+std::vector<PrimitiveSetup> RasterizerGPU::read_back_triangle_setup(const Vertex *vertices, unsigned num_vertices,
+                                                                   const uint32_t *indices, unsigned num_triangles,
+                                                                   CullMode mode, const ViewportTransform &vp)
+{
+	flush();
+
+	Impl::TriangleVertexSource source = {};
+	source.vertices = vertices;
+	source.num_vertices = num_vertices;
+
+	// Every chunk fits in one batch, so it is read back before it could be flushed.
+	std::vector<PrimitiveSetup> setups;
+	setups.reserve(size_t(num_triangles) * MAX_CLIPPED_PRIMITIVES);
+	unsigned max_triangles = impl->max_primitives / MAX_CLIPPED_PRIMITIVES;
+	for (unsigned first = 0; first < num_triangles; first += max_triangles)
+	{
+		unsigned count = std::min(num_triangles - first, max_triangles);
+		impl->queue_triangles(source, indices + 3 * first, count, mode, vp);
+		impl->read_back_staged_setup(setups);
+	}
+
+	return setups;
+}
+
+void RasterizerGPU::Impl::read_back_staged_setup(std::vector<PrimitiveSetup> &setups)
+{
+	end_staging();
+
+	VkDeviceSize pos_size = staging.count * sizeof(PrimitiveSetupPos);
+	VkDeviceSize attr_size = staging.count * sizeof(PrimitiveSetupAttr);
+	VkDeviceSize bbox_size = staging.count * sizeof(PrimitiveSetupBBox);
+
+	BufferCreateInfo info;
+	info.domain = BufferDomain::CachedHost;
+	info.size = pos_size + attr_size + bbox_size;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	auto readback = device->create_buffer(info);
+
+	// Same queue as for a regular batch, which is where end_staging() made the data available.
+	auto cmd = device->request_command_buffer(async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic);
+	cmd->barrier(VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+	             VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_WRITE_BIT);
+	run_triangle_setup(*cmd);
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	cmd->copy_buffer(*readback, 0, *staging.gpu, staging_layout.positions.offset, pos_size);
+	cmd->copy_buffer(*readback, pos_size, *staging.gpu, staging_layout.attributes.offset, attr_size);
+	cmd->copy_buffer(*readback, pos_size + attr_size, *staging.gpu, staging_layout.bboxes.offset, bbox_size);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+	auto &fence = staging_ring[staging_ring_index].fence;
+	device->submit(cmd, &fence);
+	fence->wait();
+
+	auto *mapped = static_cast<const uint8_t *>(device->map_host_buffer(*readback, MEMORY_ACCESS_READ_BIT));
+	auto *pos = reinterpret_cast<const PrimitiveSetupPos *>(mapped);
+	auto *attr = reinterpret_cast<const PrimitiveSetupAttr *>(mapped + pos_size);
+	auto *bbox = reinterpret_cast<const PrimitiveSetupBBox *>(mapped + pos_size + attr_size);
+	for (unsigned i = 0; i < staging.count; i++)
+		setups.push_back({ pos[i], attr[i], bbox[i] });
+	device->unmap_host_buffer(*readback, MEMORY_ACCESS_READ_BIT);
+
+	// Nothing was rendered, the batch is simply dropped.
+	reset_staging();
+}
+
+VertexBufferHandle RasterizerGPU::create_vertex_buffer(const StaticVertex *vertices, unsigned num_vertices)
+{
+	if (num_vertices == 0)
+		throw std::runtime_error("Vertex buffer must not be empty.");
+
+	static_assert(sizeof(StaticVertex) == 8 * sizeof(float), "StaticVertex must be tightly packed.");
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.size = num_vertices * sizeof(StaticVertex);
+	auto buffer = impl->device->create_buffer(info, vertices);
+
+	VertexBufferHandle handle;
+	if (!impl->free_static_vertex_buffers.empty())
+	{
+		handle.index = impl->free_static_vertex_buffers.back();
+		impl->free_static_vertex_buffers.pop_back();
+		impl->static_vertex_buffers[handle.index] = buffer;
+	}
+	else
+	{
+		handle.index = uint32_t(impl->static_vertex_buffers.size());
+		impl->static_vertex_buffers.push_back(buffer);
+	}
+	return handle;
+}
+
+void RasterizerGPU::destroy_vertex_buffer(VertexBufferHandle handle)
+{
+	// Queued transform jobs hold their own reference.
+	impl->static_vertex_buffers[handle.index].reset();
+	impl->free_static_vertex_buffers.push_back(handle.index);
+}
+
+void RasterizerGPU::rasterize_triangles(VertexBufferHandle vertices, const VertexTransform &transform,
+                                       const uint32_t *indices, unsigned num_triangles, CullMode mode,
+                                       const ViewportTransform &vp)
+{
+	auto &buffer = impl->static_vertex_buffers[vertices.index];
+	Impl::TriangleVertexSource source = {};
+	source.num_vertices = unsigned(buffer->get_create_info().size / sizeof(StaticVertex));
+	source.vertex_buffer = vertices.index;
+	source.transform = &transform;
+	impl->queue_triangles(source, indices, num_triangles, mode, vp);
+}
+
+RenderStateBlock RasterizerGPU::create_render_state_block()
+{
+	std::lock_guard<std::mutex> holder{impl->submission_lock};
+	return impl->create_render_state_block();
+}
+
+void RasterizerGPU::rasterize_primitives(RenderStateBlock block, const PrimitiveSetup *setup, size_t count)
+{
+	impl->queue_primitives(block.index, setup, count);
+}
+
 ImageHandle RasterizerGPU::copy_to_framebuffer()
 {
 	flush();
+	impl->resolve_fast_clears();
 	return impl->copy_to_framebuffer();
 }
 
 ImageHandle RasterizerGPU::Impl::copy_to_framebuffer()
 {
-	ImageCreateInfo info = ImageCreateInfo::immutable_2d_image(color.width, color.height, VK_FORMAT_A1R5G5B5_UNORM_PACK16);
-	info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-	auto image = device->create_image(info);
+	auto &image = scanout_ring.images[scanout_ring.index];
+	scanout_ring.index = (scanout_ring.index + 1) % NUM_SCANOUT_IMAGES;
+
+	if (!image || image->get_width() != color.width || image->get_height() != color.height)
+	{
+		ImageCreateInfo info = ImageCreateInfo::immutable_2d_image(color.width, color.height, VK_FORMAT_A1R5G5B5_UNORM_PACK16);
+		info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		image = device->create_image(info);
+	}
 
 	auto cmd = device->request_command_buffer();
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
 	             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	// The previous contents are discarded, but reads from when the image was last presented must complete first.
 	cmd->image_barrier(*image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-	                   VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+	                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
 	                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
 	cmd->copy_buffer_to_image(*image, *vram_buffer, color.offset, {}, { color.width, color.height, 1 }, color.stride / 2, 0,
 	                          { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
@@ -1328,29 +3179,23 @@ ImageHandle RasterizerGPU::Impl::copy_to_framebuffer()
 	                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
 	                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 	device->submit(cmd);
+	generic_since_upload = true;
 	return image;
 }
 
-bool RasterizerGPU::save_canvas(const char *path)
+void RasterizerGPU::scanout(const RenderPassInfo &rp)
 {
-	impl->flush();
-
-	auto cmd = impl->device->request_command_buffer();
-	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_TRANSFER_BIT,
-	             VK_ACCESS_TRANSFER_READ_BIT);
+	flush();
+	impl->resolve_fast_clears();
+	impl->scanout(rp);
+}
 
-	BufferCreateInfo info;
-	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-	info.domain = BufferDomain::CachedHost;
-	info.size = impl->color.width * impl->color.height * sizeof(uint16_t);
-	auto dst_buffer = impl->device->create_buffer(info);
-	cmd->set_program("assets://shaders/read_framebuffer.comp", {{ "TILE_SIZE", impl->tile_size }});
-	cmd->set_storage_buffer(0, 0, *dst_buffer);
-	cmd->set_storage_buffer(0, 1, *impl->vram_buffer);
+void RasterizerGPU::Impl::scanout(const RenderPassInfo &rp)
+{
+	auto cmd = device->request_command_buffer();
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+	             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	cmd->begin_render_pass(rp);
 
 	struct Registers
 	{
@@ -1359,13 +3204,136 @@ bool RasterizerGPU::save_canvas(const char *path)
 		uint32_t height;
 		uint32_t stride;
 	} registers;
-	registers.offset = impl->color.offset >> 1;
-	registers.width = impl->color.width;
-	registers.height = impl->color.height;
-	registers.stride = impl->color.stride >> 1;
+	registers.offset = color.offset >> 1;
+	registers.width = color.width;
+	registers.height = color.height;
+	registers.stride = color.stride >> 1;
 	cmd->push_constants(&registers, 0, sizeof(registers));
+	cmd->set_storage_buffer(0, 0, *vram_buffer);
+	CommandBufferUtil::draw_fullscreen_quad(*cmd, "builtin://shaders/quad.vert", "assets://shaders/scanout.frag");
+
+	cmd->end_render_pass();
+	device->submit(cmd);
+	generic_since_upload = true;
+}
+
+void RasterizerGPU::Impl::record_framebuffer_readback(CommandBuffer &cmd, const Buffer &dst)
+{
+	cmd.barrier(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	            VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
-	cmd->dispatch((impl->color.width + 15) / 16, (impl->color.height + 15) / 16, 1);
+	cmd.set_program("assets://shaders/read_framebuffer.comp", {{ "TILE_SIZE", tile_size }});
+	cmd.set_storage_buffer(0, 0, dst);
+	cmd.set_storage_buffer(0, 1, *vram_buffer);
+
+	struct Registers
+	{
+		uint32_t offset;
+		uint32_t width;
+		uint32_t height;
+		uint32_t stride;
+	} registers;
+	registers.offset = color.offset >> 1;
+	registers.width = color.width;
+	registers.height = color.height;
+	registers.stride = color.stride >> 1;
+	cmd.push_constants(&registers, 0, sizeof(registers));
+
+	cmd.dispatch((color.width + 15) / 16, (color.height + 15) / 16, 1);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+}
+
+void RasterizerGPU::Impl::complete_readback(ReadbackSlot &slot)
+{
+	slot.fence->wait();
+	slot.fence.reset();
+
+	std::vector<uint16_t> pixels(slot.width * slot.height);
+	auto *ptr = static_cast<const uint16_t *>(device->map_host_buffer(*slot.buffer, MEMORY_ACCESS_READ_BIT));
+	memcpy(pixels.data(), ptr, pixels.size() * sizeof(uint16_t));
+	device->unmap_host_buffer(*slot.buffer, MEMORY_ACCESS_READ_BIT);
+
+	// The callback may queue another readback, so release the slot first.
+	auto callback = std::move(slot.callback);
+	slot.callback = {};
+	callback(std::move(pixels), slot.width, slot.height);
+}
+
+void RasterizerGPU::Impl::poll_readbacks(bool wait)
+{
+	// readback.index is the oldest slot. Stop at the first incomplete one to keep callbacks in order.
+	for (unsigned i = 0; i < NUM_READBACK_BUFFERS; i++)
+	{
+		auto &slot = readback.slots[(readback.index + i) % NUM_READBACK_BUFFERS];
+		if (!slot.fence)
+			continue;
+		if (!wait && !slot.fence->wait_timeout(0))
+			break;
+		complete_readback(slot);
+	}
+}
+
+void RasterizerGPU::Impl::read_canvas_async(RasterizerGPU::ReadbackCallback callback)
+{
+	// If every slot is in flight, this is the oldest one, and it has to complete before its buffer is reused.
+	auto &slot = readback.slots[readback.index];
+	if (slot.fence)
+		complete_readback(slot);
+	readback.index = (readback.index + 1) % NUM_READBACK_BUFFERS;
+
+	VkDeviceSize size = color.width * color.height * sizeof(uint16_t);
+	if (!slot.buffer || slot.buffer->get_create_info().size < size)
+	{
+		BufferCreateInfo info;
+		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+		info.domain = BufferDomain::CachedHost;
+		info.size = size;
+		slot.buffer = device->create_buffer(info);
+	}
+
+	slot.width = color.width;
+	slot.height = color.height;
+	slot.callback = std::move(callback);
+
+	auto cmd = device->request_command_buffer();
+	record_framebuffer_readback(*cmd, *slot.buffer);
+	device->submit(cmd, &slot.fence);
+	generic_since_upload = true;
+}
+
+void RasterizerGPU::read_canvas_async(ReadbackCallback callback)
+{
+	flush();
+	impl->resolve_fast_clears();
+	impl->read_canvas_async(std::move(callback));
+}
+
+void RasterizerGPU::poll_readbacks()
+{
+	impl->poll_readbacks(false);
+}
+
+void RasterizerGPU::wait_readbacks()
+{
+	impl->poll_readbacks(true);
+}
+
+bool RasterizerGPU::save_canvas(const char *path)
+{
+	impl->flush();
+	impl->resolve_fast_clears();
+
+	BufferCreateInfo info;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.domain = BufferDomain::CachedHost;
+	info.size = impl->color.width * impl->color.height * sizeof(uint16_t);
+	auto dst_buffer = impl->device->create_buffer(info);
+
+	auto cmd = impl->device->request_command_buffer();
+	impl->record_framebuffer_readback(*cmd, *dst_buffer);
 
 	Fence fence;
 	impl->device->submit(cmd, &fence);
@@ -1390,26 +3358,324 @@ bool RasterizerGPU::save_canvas(const char *path)
 	return res;
 }
 
-void RasterizerGPU::init(Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size)
+void RasterizerGPU::init(Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size,
+                         unsigned max_primitives, unsigned num_batches_in_flight)
 {
-	impl->init(device, subgroup, ubershader, async_compute, tile_size);
+	impl->init(device, subgroup, ubershader, async_compute, tile_size, max_primitives, num_batches_in_flight);
 }
 
 void RasterizerGPU::flush()
 {
+	std::unique_lock<std::mutex> holder{impl->submission_lock};
+	impl->submission_idle.wait(holder, [this]() { return impl->active_writers == 0; });
 	impl->flush();
 }
 
+void RasterizerGPU::Impl::flush_primitives()
+{
+	std::unique_lock<std::mutex> holder{submission_lock};
+	submission_idle.wait(holder, [this]() { return active_writers == 0; });
+	if (staging.count != 0)
+		flush();
+}
+
 void RasterizerGPU::Impl::flush()
 {
-	if (ubershader)
-		flush_ubershader();
+	// Textures made resident while building this batch must land first.
+	submit_texture_uploads();
+
+	if (recording_list != ~0u)
+		record_batch();
 	else
-		flush_split();
+	{
+		end_staging();
+		if (staging.count != 0)
+		{
+			int next_tile_size = select_tile_size();
+
+			// The staging buffer can be recycled once the batch has completed.
+			auto *fence = &staging_ring[staging_ring_index].fence;
+			submit_batch(fence);
+
+			// The batch was set up for the current grid, a new tile size applies from the next one.
+			set_tile_size(next_tile_size);
+		}
+	}
 
 	reset_staging();
 }
 
+void RasterizerGPU::Impl::record_batch()
+{
+	end_staging();
+	if (staging.count == 0)
+		return;
+
+	RecordedBatch batch;
+	batch.count = staging.count;
+	batch.num_conservative_tile_instances = staging.num_conservative_tile_instances;
+	batch.render_state_count = state.render_state_count;
+	batch.depth_changes = state.depth_changes;
+	batch.deferred = state.deferred;
+	batch.ubershader_rop = state.ubershader_rop;
+	batch.tile_size = tile_size;
+	batch.shader_states.assign(state.shader_states, state.shader_states + state.shader_state_count);
+
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.size = staging_layout.size;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+	             VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	batch.buffer = device->create_buffer(info);
+
+	// Copy on the queue binning runs on, which is also where end_staging() made the data available.
+	auto cmd = device->request_command_buffer(async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic);
+	cmd->barrier(VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+	             VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+	// The list captures set up primitives, so replaying it skips triangle setup entirely.
+	if (!triangle_setup.jobs.empty())
+	{
+		run_triangle_setup(*cmd);
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	}
+
+	const auto copy_region = [&](const StagingRegion &region, VkDeviceSize size) {
+		cmd->copy_buffer(*batch.buffer, region.offset, *staging.gpu, region.offset, size);
+	};
+	copy_region(staging_layout.positions, staging.count * sizeof(PrimitiveSetupPos));
+	copy_region(staging_layout.attributes, staging.count * sizeof(PrimitiveSetupAttr));
+	copy_region(staging_layout.bboxes, staging.count * sizeof(PrimitiveSetupBBox));
+	copy_region(staging_layout.shader_state_index, staging.count * sizeof(uint8_t));
+	copy_region(staging_layout.render_state_index, staging.count * sizeof(uint16_t));
+	copy_region(staging_layout.render_state, state.render_state_count * sizeof(RenderState));
+
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT);
+	device->submit(cmd, &staging_ring[staging_ring_index].fence);
+
+	command_lists[recording_list].batches.push_back(std::move(batch));
+}
+
+void RasterizerGPU::Impl::execute_command_list(const RecordedCommandList &list)
+{
+	// Anything queued so far renders first.
+	flush();
+
+	for (auto &batch : list.batches)
+	{
+		// Tile instance counts were computed for the grid the batch was recorded with.
+		set_tile_size(batch.tile_size);
+
+		// Point the batch at the recorded buffer. It is device local, so end_staging() has nothing to do.
+		staging.gpu = batch.buffer;
+		staging.host_visible = true;
+		staging.count = batch.count;
+		staging.num_conservative_tile_instances = batch.num_conservative_tile_instances;
+		state.render_state_count = batch.render_state_count;
+		state.depth_changes = batch.depth_changes;
+		state.deferred = batch.deferred;
+		state.ubershader_rop = batch.ubershader_rop;
+		state.shader_state_count = unsigned(batch.shader_states.size());
+		std::copy(batch.shader_states.begin(), batch.shader_states.end(), state.shader_states);
+
+		// Recorded buffers are kept alive by the batches referencing them, no fence to track.
+		submit_batch(nullptr);
+		reset_staging();
+	}
+}
+
+void RasterizerGPU::begin_command_list()
+{
+	std::unique_lock<std::mutex> holder{impl->submission_lock};
+	impl->submission_idle.wait(holder, [this]() { return impl->active_writers == 0; });
+	assert(impl->recording_list == ~0u);
+
+	// Pending primitives are not part of the list.
+	impl->flush();
+
+	uint32_t index;
+	if (!impl->free_command_lists.empty())
+	{
+		index = impl->free_command_lists.back();
+		impl->free_command_lists.pop_back();
+	}
+	else
+	{
+		index = uint32_t(impl->command_lists.size());
+		impl->command_lists.emplace_back();
+	}
+	impl->recording_list = index;
+}
+
+CommandList RasterizerGPU::end_command_list()
+{
+	std::unique_lock<std::mutex> holder{impl->submission_lock};
+	impl->submission_idle.wait(holder, [this]() { return impl->active_writers == 0; });
+	assert(impl->recording_list != ~0u);
+
+	impl->flush();
+	CommandList list;
+	list.index = impl->recording_list;
+	impl->recording_list = ~0u;
+	return list;
+}
+
+void RasterizerGPU::execute_command_list(CommandList list)
+{
+	std::unique_lock<std::mutex> holder{impl->submission_lock};
+	impl->submission_idle.wait(holder, [this]() { return impl->active_writers == 0; });
+	assert(impl->recording_list == ~0u);
+	impl->execute_command_list(impl->command_lists[list.index]);
+}
+
+void RasterizerGPU::destroy_command_list(CommandList list)
+{
+	std::lock_guard<std::mutex> holder{impl->submission_lock};
+	impl->command_lists[list.index].batches.clear();
+	impl->free_command_lists.push_back(list.index);
+}
+
+void RasterizerGPU::Impl::add_sample(StatsWindow &window, double value)
+{
+	if (window.samples.size() < STATS_WINDOW_SIZE)
+		window.samples.push_back(value);
+	else
+		window.samples[window.next] = value;
+	window.next = (window.next + 1) % STATS_WINDOW_SIZE;
+}
+
+RasterizerDistribution RasterizerGPU::Impl::summarize(const StatsWindow &window)
+{
+	RasterizerDistribution dist;
+	if (window.samples.empty())
+		return dist;
+
+	auto sorted = window.samples;
+	std::sort(sorted.begin(), sorted.end());
+
+	double total = 0.0;
+	for (auto sample : sorted)
+		total += sample;
+
+	// Nearest-rank percentiles.
+	const auto percentile = [&](double p) -> double {
+		size_t rank = size_t(std::ceil(p * double(sorted.size())));
+		return sorted[std::max<size_t>(rank, 1) - 1];
+	};
+
+	dist.min = sorted.front();
+	dist.mean = total / double(sorted.size());
+	dist.p50 = percentile(0.50);
+	dist.p99 = percentile(0.99);
+	dist.num_samples = unsigned(sorted.size());
+	return dist;
+}
+
+void RasterizerGPU::Impl::register_stage_time(const QueryPoolHandle &start, const QueryPoolHandle &end,
+                                              RasterizerStage stage, const char *tag)
+{
+	device->register_time_interval(start, end, tag);
+
+	std::lock_guard<std::mutex> holder{stats.lock};
+	resolve_pending_timestamps();
+	// Timestamps which never resolve, e.g. if the device does not support them, must not pile up.
+	if (stats.pending.size() >= MAX_PENDING_TIMESTAMPS)
+		stats.pending.erase(stats.pending.begin());
+	stats.pending.push_back({ start, end, stage });
+}
+
+void RasterizerGPU::Impl::resolve_pending_timestamps()
+{
+	auto itr = std::remove_if(stats.pending.begin(), stats.pending.end(), [this](const PendingTimestamps &pending) {
+		if (!pending.start->is_signalled() || !pending.end->is_signalled())
+			return false;
+		double elapsed = pending.end->get_timestamp() - pending.start->get_timestamp();
+		add_sample(stats.stage_times[unsigned(pending.stage)], 1000.0 * elapsed);
+		return true;
+	});
+	stats.pending.erase(itr, stats.pending.end());
+}
+
+void RasterizerGPU::Impl::record_flush_stats()
+{
+	// The ubershader handles every shader state in one dispatch.
+	unsigned num_variants = ubershader ? 1 : state.shader_state_count;
+
+	std::lock_guard<std::mutex> holder{stats.lock};
+	add_sample(stats.primitives, staging.count);
+	add_sample(stats.tile_instances, staging.num_conservative_tile_instances);
+	add_sample(stats.shader_variants, num_variants);
+	stats.num_flushes++;
+	stats.num_primitives += staging.count;
+	stats.num_tile_instances += staging.num_conservative_tile_instances;
+}
+
+RasterizerStats RasterizerGPU::get_stats()
+{
+	auto &stats = impl->stats;
+	std::lock_guard<std::mutex> holder{stats.lock};
+	impl->resolve_pending_timestamps();
+
+	RasterizerStats result;
+	for (unsigned i = 0; i < unsigned(RasterizerStage::Count); i++)
+		result.stage_time_ms[i] = Impl::summarize(stats.stage_times[i]);
+	result.primitives_per_flush = Impl::summarize(stats.primitives);
+	result.tile_instances_per_flush = Impl::summarize(stats.tile_instances);
+	result.shader_variants_per_flush = Impl::summarize(stats.shader_variants);
+	result.num_flushes = stats.num_flushes;
+	result.num_primitives = stats.num_primitives;
+	result.num_tile_instances = stats.num_tile_instances;
+	return result;
+}
+
+void RasterizerGPU::reset_stats()
+{
+	auto &stats = impl->stats;
+	std::lock_guard<std::mutex> holder{stats.lock};
+	// Timestamps still in flight are dropped as well, so they do not leak into the new window.
+	stats.pending.clear();
+	for (auto &window : stats.stage_times)
+		window = {};
+	stats.primitives = {};
+	stats.tile_instances = {};
+	stats.shader_variants = {};
+	stats.num_flushes = 0;
+	stats.num_primitives = 0;
+	stats.num_tile_instances = 0;
+}
+
+const char *RasterizerGPU::get_stage_name(RasterizerStage stage)
+{
+	switch (stage)
+	{
+	case RasterizerStage::BinningLowRes:
+		return "binning-low-res";
+	case RasterizerStage::BinningFullRes:
+		return "binning-full-res";
+	case RasterizerStage::Combiner:
+		return "combiner";
+	case RasterizerStage::ROP:
+		return "rop";
+	case RasterizerStage::Batch:
+		return "batch";
+	case RasterizerStage::TextureUpload:
+		return "texture-upload";
+	case RasterizerStage::Clear:
+		return "clear";
+	case RasterizerStage::ClearResolve:
+		return "clear-resolve";
+	case RasterizerStage::TriangleSetup:
+		return "triangle-setup";
+	default:
+		return "unknown";
+	}
+}
+
 void RasterizerGPU::set_constant_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 {
 	impl->state.current_render_state.constant_color[0] = r;
@@ -1428,4 +3694,21 @@ void RasterizerGPU::set_combiner_mode(CombinerFlags flags)
 	impl->state.current_render_state.combiner_state = flags;
 }
 
+void RasterizerGPU::set_deferred_shading(bool enable)
+{
+	impl->deferred_shading = enable;
+}
+
+void RasterizerGPU::set_adaptive_tile_size(bool enable)
+{
+	flush();
+	impl->resolve_fast_clears();
+	impl->adaptive_tile_size.enable = enable;
+	impl->adaptive_tile_size.instances_per_primitive = -1.0f;
+	if (!enable)
+		impl->set_tile_size(impl->adaptive_tile_size.fixed_tile_size);
+	// Per-tile buffers are sized for the smaller tile size while adapting.
+	impl->resize_tile_grid();
+}
+
 }
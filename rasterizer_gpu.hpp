@@ -3,8 +3,11 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "primitive_setup.hpp"
+#include "triangle_converter.hpp"
 #include "texture_format.hpp"
 #include <memory>
+#include <vector>
+#include <functional>
 #include "device.hpp"
 #include "math.hpp"
 
@@ -47,16 +50,26 @@ enum CombinerState
 };
 using CombinerFlags = uint8_t;
 
+// The low two bits are log2 of texels per 16-bit VRAM word, or of indices per word for VQ.
 enum TextureFormatBits
 {
 	TEXTURE_FMT_ARGB1555 = 0,
 	TEXTURE_FMT_I8 = 1,
+	// 4-bit and 8-bit indices into an ARGB1555 CLUT of 16 or 256 entries.
+	TEXTURE_FMT_PAL4 = 2,
 	TEXTURE_FMT_LA88 = 4,
+	TEXTURE_FMT_PAL8 = 5,
+	// 8-bit indices into a codebook of 256 ARGB1555 2x2 texel blocks, one index per 2x2 texels.
+	TEXTURE_FMT_VQ = 9,
 	TEXTURE_FMT_FILTER_MIP_LINEAR_BIT = 0x40,
 	TEXTURE_FMT_FILTER_LINEAR_BIT = 0x80
 };
 using TextureFormatFlags = uint8_t;
 
+// Paletted and VQ formats keep the VRAM offset of their CLUT or codebook in this texture_offset slot,
+// so they have at most 7 levels.
+static constexpr unsigned TEXTURE_PALETTE_LEVEL = 7;
+
 struct TextureDescriptor
 {
 	// 16 bytes.
@@ -70,13 +83,116 @@ struct TextureDescriptor
 	uint32_t texture_offset[8] = {};
 };
 
+// Handle to an immutable snapshot of render state, see RasterizerGPU::create_render_state_block().
+struct RenderStateBlock
+{
+	uint32_t index = ~0u;
+};
+
+// Handle to a recorded sequence of primitives, see RasterizerGPU::begin_command_list().
+struct CommandList
+{
+	uint32_t index = ~0u;
+};
+
+// Handle to a texture whose VRAM residency is managed by the rasterizer, see RasterizerGPU::create_texture().
+struct TextureHandle
+{
+	uint32_t index = ~0u;
+};
+
+// Handle to static vertices in device memory, see RasterizerGPU::create_vertex_buffer().
+struct VertexBufferHandle
+{
+	uint32_t index = ~0u;
+};
+
+// Untransformed vertex, the input to the GPU vertex transform.
+struct StaticVertex
+{
+	float position[3];
+	float normal[3];
+	float u;
+	float v;
+};
+
+// Per-instance state for the GPU vertex transform. Positions are transformed by mvp with w = 1.
+// The lit color is clamp(dot(n, light_direction), 0, 1) * diffuse + ambient, with alpha 1,
+// where n is the normalized result of normal_matrix times the vertex normal.
+struct VertexTransform
+{
+	muglm::mat4 mvp;
+	muglm::mat3 normal_matrix;
+	muglm::vec3 light_direction;
+	float diffuse;
+	float ambient;
+};
+
+struct TextureLevel
+{
+	const uint32_t *data;
+	unsigned width;
+	unsigned height;
+};
+
+// GPU stages which are timed with timestamps, see RasterizerGPU::get_stats().
+enum class RasterizerStage : unsigned
+{
+	BinningLowRes = 0,
+	BinningFullRes,
+	Combiner,
+	// The ROP pass, or the whole shading pass with the ubershader.
+	ROP,
+	// A whole batch, from low-res binning to the end of ROP.
+	Batch,
+	TextureUpload,
+	Clear,
+	ClearResolve,
+	// Triangle setup for rasterize_triangles(), including any vertex transforms.
+	TriangleSetup,
+	Count
+};
+
+// Summary of the samples in a rolling window.
+struct RasterizerDistribution
+{
+	double min = 0.0;
+	double mean = 0.0;
+	double p50 = 0.0;
+	double p99 = 0.0;
+	unsigned num_samples = 0;
+};
+
+struct RasterizerStats
+{
+	// GPU time in milliseconds. Timestamps are read back once the GPU has completed the work,
+	// so the window lags submission by a few frames.
+	RasterizerDistribution stage_time_ms[unsigned(RasterizerStage::Count)];
+
+	// Per-flush counts. Tile instances are the conservative estimate from primitive bounding boxes,
+	// which is what the tile buffers are sized for.
+	RasterizerDistribution primitives_per_flush;
+	RasterizerDistribution tile_instances_per_flush;
+	RasterizerDistribution shader_variants_per_flush;
+
+	// Totals since init or the last reset_stats().
+	uint64_t num_flushes = 0;
+	uint64_t num_primitives = 0;
+	uint64_t num_tile_instances = 0;
+};
+
 class RasterizerGPU
 {
 public:
 	RasterizerGPU();
 	~RasterizerGPU();
 
-	void init(Vulkan::Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size);
+	// max_primitives is the number of primitives which can be rasterized in one batch before an implicit flush.
+	// Must be a multiple of 1024, up to 256Ki. Binning and tile memory scale linearly with it.
+	// num_batches_in_flight (2 to 4) is how many flushed batches may be queued on the GPU at once,
+	// so binning and shading of later batches can overlap ROP of earlier ones.
+	void init(Vulkan::Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size,
+	          unsigned max_primitives = 0x4000, unsigned num_batches_in_flight = 3);
 
 	void set_depth_state(DepthTest mode, DepthWrite write);
 	void set_rop_state(BlendState state);
@@ -85,22 +201,142 @@ public:
 	void set_constant_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
 	void set_combiner_mode(CombinerFlags flags);
 
+	// Split shader architecture only. Batches in which every primitive uses BlendState::Replace without
+	// alpha threshold resolve depth per tile first, and only shade the primitive which ends up visible
+	// in each pixel. Such batches skip the combiner pass and need no tile instance memory.
+	// Applies to batches flushed from here on, and to command lists recorded from here on.
+	void set_deferred_shading(bool enable);
+
+	// Switches between 8x8 and 16x16 tiles per flush, starting from the tile size passed to init().
+	// Batches of large primitives go to 16x16 tiles to cut tile instances, batches of small primitives to 8x8
+	// to shade fewer empty pixels. A switch resolves pending clears, and Hi-Z culling resumes a few flushes later.
+	// Command lists replay with the tile size each batch was recorded with.
+	void set_adaptive_tile_size(bool enable);
+
 	void set_color_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride);
 	void set_depth_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride);
 
+	// Clears only record per-tile metadata. The clear value is applied as tiles are rendered to,
+	// and any untouched tiles are resolved before VRAM is read back or the framebuffer changes.
 	void clear_depth(uint16_t z = 0xffff);
 	void clear_color(uint32_t rgba = 0);
 	bool save_canvas(const char *path);
 
+	// Receives the color framebuffer as tightly packed ARGB1555 pixels.
+	using ReadbackCallback = std::function<void (std::vector<uint16_t> pixels, unsigned width, unsigned height)>;
+	// Queues a copy of the color framebuffer into a small ring of host buffers without waiting for the GPU.
+	// The callback runs on the calling thread from poll_readbacks(), wait_readbacks(), or from a later
+	// read_canvas_async() which needs to recycle the buffer. Callbacks run in submission order.
+	void read_canvas_async(ReadbackCallback callback);
+	// Runs callbacks for readbacks which have completed, without blocking.
+	void poll_readbacks();
+	// Blocks until all queued readbacks have completed and their callbacks have run.
+	void wait_readbacks();
+
 	void rasterize_primitives(const PrimitiveSetup *setup, size_t count);
 
+	// Captures the current state (as set by the set_* calls, including scissor) into an immutable block.
+	// Identical states return the same block. Blocks remain valid for the lifetime of the rasterizer.
+	RenderStateBlock create_render_state_block();
+	// Renders primitives with a prebuilt state block. The current state set by set_* calls is ignored,
+	// and is not modified.
+	// This call, create_render_state_block() and flush() may be used concurrently from multiple threads.
+	// Each call reserves contiguous ranges in the batch, so primitives are ordered by reservation order
+	// between threads, and by submission order within one call.
+	// A full batch is flushed on whichever thread runs out of space, so every submitting thread needs
+	// a Granite thread index of its own. None of the other calls may overlap with concurrent submission.
+	void rasterize_primitives(RenderStateBlock block, const PrimitiveSetup *setup, size_t count);
+
+	// Clips and sets up triangles on the GPU, producing the same primitives as setup_clipped_triangles()
+	// bit for bit. indices holds three indices per triangle, all of which must be less than num_vertices.
+	// Uses the current state like rasterize_primitives(). Every triangle reserves room for the most
+	// primitives clipping can produce, so a batch holds fewer triangles than set up primitives.
+	// With the split shader architecture, batches with triangles set up on the GPU render with the ubershader ROP,
+	// since their tile instance footprint is only known on the GPU.
+	void rasterize_triangles(const Vertex *vertices, unsigned num_vertices, const uint32_t *indices,
+	                         unsigned num_triangles, CullMode mode, const ViewportTransform &vp);
+
+	// For verifying triangle_setup.comp. Sets up triangles like rasterize_triangles(), but reads the primitives
+	// back instead of rendering them. Returns MAX_CLIPPED_PRIMITIVES (8) slots per triangle, in the order
+	// setup_clipped_triangles() produces them. Bounding boxes are clipped against the current scissor, and slots
+	// without a primitive, or with one which is scissored out, have an empty bounding box (min_x > max_x).
+	// Flushes and waits for the GPU.
+	std::vector<PrimitiveSetup> read_back_triangle_setup(const Vertex *vertices, unsigned num_vertices,
+	                                                     const uint32_t *indices, unsigned num_triangles,
+	                                                     CullMode mode, const ViewportTransform &vp);
+
+	// Uploads vertices to device memory once, so they can be transformed on the GPU every frame.
+	VertexBufferHandle create_vertex_buffer(const StaticVertex *vertices, unsigned num_vertices);
+	// The buffer may still be referenced by batches in flight, it is released once they complete.
+	void destroy_vertex_buffer(VertexBufferHandle handle);
+	// Like rasterize_triangles(), but the vertices are transformed and lit on the GPU first.
+	// Indices must be less than the vertex count of the buffer. The results may differ from the
+	// same transform on the CPU in the last bits, as the GPU is free to contract into FMA.
+	void rasterize_triangles(VertexBufferHandle vertices, const VertexTransform &transform, const uint32_t *indices,
+	                         unsigned num_triangles, CullMode mode, const ViewportTransform &vp);
+
 	void set_texture_descriptor(const TextureDescriptor &desc);
+
+	// Primitives rasterized between begin_command_list() and end_command_list() are uploaded to device local
+	// memory instead of being rendered. Executing the list later only costs the GPU passes, with no
+	// per-primitive CPU work. State is captured as with immediate submission, including scissor and
+	// texture addresses, so textures used by a list must stay resident while the list is in use.
+	// Clears and framebuffer changes are not recorded and take effect immediately.
+	void begin_command_list();
+	CommandList end_command_list();
+	// Renders to the current framebuffers.
+	void execute_command_list(CommandList list);
+	void destroy_command_list(CommandList list);
+
+	// Sub-allocates VRAM, e.g. for framebuffers. Textures which have not been used in the current frame
+	// are evicted if VRAM is full. Returns false if no space could be found.
+	bool allocate_vram(uint32_t size, uint32_t alignment, uint32_t &offset);
+	void free_vram(uint32_t offset);
+
+	// Registers an RGBA8888 mip chain, up to 8 levels. The data is copied, so the texture can be
+	// uploaded on demand and re-uploaded after eviction. texture_offset in desc is ignored.
+	// Paletted and VQ formats are quantized here, with one CLUT or codebook shared by all levels.
+	TextureHandle create_texture(const TextureDescriptor &desc, const TextureLevel *levels, unsigned num_levels);
+	// Makes the texture resident, evicting least recently used textures if needed, and sets it as
+	// the current texture descriptor. Returns false if the texture does not fit in VRAM.
+	// State blocks capture the VRAM address, so textures used through blocks must be set
+	// every frame they are used to avoid eviction.
+	bool set_texture(TextureHandle handle);
+	// Marks the start of a new frame. Textures not set since then become candidates for eviction.
+	void next_frame();
+	// For paletted formats, the red channel of src holds the index. For VQ, src is the index map of
+	// (width + 1) / 2 by (height + 1) / 2 codebook indices.
 	void copy_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt);
+	// Paletted and VQ formats only. Quantizes src to 16 or 256 colors, or 256 2x2 blocks, and writes the ARGB1555
+	// CLUT of 16 or 256 entries, or codebook of 1024 texels, to palette_offset, which goes into
+	// texture_offset[TEXTURE_PALETTE_LEVEL]. A VQ codebook fitted to one level does not carry over to other levels.
+	// The upload writes whole 128 byte blocks, so reserve 128, 512 or 2048 bytes at palette_offset.
+	void copy_texture_rgba8888_to_vram(uint32_t offset, uint32_t palette_offset, const uint32_t *src,
+	                                   unsigned width, unsigned height, TextureFormatBits fmt);
 
+	// Batched variant of copy_texture_rgba8888_to_vram. Source data is copied into an upload arena right away,
+	// and all queued uploads are recorded into one command buffer by submit_texture_uploads().
+	// Rendering submitted after that is ordered after the uploads. The returned fence signals once the uploads
+	// have completed, and the upload arena is recycled after that point.
+	void queue_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt);
+	void queue_texture_rgba8888_to_vram(uint32_t offset, uint32_t palette_offset, const uint32_t *src,
+	                                    unsigned width, unsigned height, TextureFormatBits fmt);
+	Vulkan::Fence submit_texture_uploads();
+
+	// Copies the color framebuffer into one of a small ring of persistent images.
+	// The image contents are overwritten three calls later.
 	Vulkan::ImageHandle copy_to_framebuffer();
+	// Draws the color framebuffer straight from VRAM into a render pass with nearest filtering,
+	// skipping the intermediate image. Submits its own command buffer.
+	void scanout(const Vulkan::RenderPassInfo &rp);
 
 	void flush();
 
+	// Statistics over a rolling window of the most recent samples. Safe to call from any thread.
+	RasterizerStats get_stats();
+	void reset_stats();
+	static const char *get_stage_name(RasterizerStage stage);
+
 private:
 	struct Impl;
 	std::unique_ptr<Impl> impl;
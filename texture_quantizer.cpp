@@ -0,0 +1,422 @@
+#include "texture_quantizer.hpp"
+#include <algorithm>
+#include <limits>
+#include <assert.h>
+
+namespace RetroWarp
+{
+static constexpr uint16_t INVALID_INDEX = 0xffff;
+static constexpr unsigned VQ_TRAINING_ITERATIONS = 8;
+// Beyond this many distinct blocks, k-means runs on an evenly spaced subset.
+static constexpr size_t VQ_MAX_TRAINING_BLOCKS = 0x4000;
+static constexpr unsigned VQ_CHANNELS = VectorQuantizer::BLOCK_TEXELS * 4;
+
+struct HistogramEntry
+{
+	uint32_t color;
+	uint32_t count;
+};
+
+struct BlockEntry
+{
+	uint64_t block;
+	uint32_t count;
+	float channels[VQ_CHANNELS];
+};
+
+// Range of histogram entries which maps to one palette entry.
+struct ColorBox
+{
+	size_t begin;
+	size_t end;
+	uint64_t count;
+	int channel;
+	int range;
+};
+
+static uint32_t rgba8888_to_argb1555(uint32_t pixel)
+{
+	uint32_t r = (pixel >> 3) & 31;
+	uint32_t g = (pixel >> 11) & 31;
+	uint32_t b = (pixel >> 19) & 31;
+	uint32_t a = pixel >> 31;
+	return (a << 15) | (r << 10) | (g << 5) | b;
+}
+
+// Alpha is scaled to the range of the color channels, so transparent and opaque colors are split apart first,
+// and never match each other while a palette entry of the same alpha exists.
+static void unpack_channels(uint32_t color, int (&channels)[4])
+{
+	channels[0] = int(color >> 10) & 31;
+	channels[1] = int(color >> 5) & 31;
+	channels[2] = int(color >> 0) & 31;
+	channels[3] = int((color >> 15) & 1) * 31;
+}
+
+static void analyze_box(const std::vector<HistogramEntry> &entries, ColorBox &box)
+{
+	int lo[4] = { 31, 31, 31, 31 };
+	int hi[4] = {};
+	box.count = 0;
+
+	for (size_t i = box.begin; i < box.end; i++)
+	{
+		int channels[4];
+		unpack_channels(entries[i].color, channels);
+		for (unsigned c = 0; c < 4; c++)
+		{
+			lo[c] = std::min(lo[c], channels[c]);
+			hi[c] = std::max(hi[c], channels[c]);
+		}
+		box.count += entries[i].count;
+	}
+
+	box.channel = 0;
+	box.range = -1;
+	for (int c = 0; c < 4; c++)
+	{
+		if (hi[c] - lo[c] > box.range)
+		{
+			box.range = hi[c] - lo[c];
+			box.channel = c;
+		}
+	}
+}
+
+PaletteQuantizer::PaletteQuantizer()
+	: histogram(0x10000)
+{
+}
+
+void PaletteQuantizer::add_pixels(const uint32_t *pixels, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		histogram[rgba8888_to_argb1555(pixels[i])]++;
+}
+
+void PaletteQuantizer::build_palette(unsigned num_colors)
+{
+	assert(num_colors != 0 && num_colors <= 256);
+
+	std::vector<HistogramEntry> entries;
+	for (uint32_t color = 0; color < 0x10000; color++)
+		if (histogram[color])
+			entries.push_back({ color, histogram[color] });
+
+	std::vector<ColorBox> boxes;
+	if (!entries.empty())
+	{
+		ColorBox box = { 0, entries.size() };
+		analyze_box(entries, box);
+		boxes.push_back(box);
+	}
+
+	while (boxes.size() < num_colors)
+	{
+		// Split the box where the widest channel covers the most pixels.
+		size_t split = boxes.size();
+		uint64_t best_score = 0;
+		for (size_t i = 0; i < boxes.size(); i++)
+		{
+			uint64_t score = boxes[i].count * uint64_t(boxes[i].range);
+			if (boxes[i].range > 0 && (split == boxes.size() || score > best_score))
+			{
+				split = i;
+				best_score = score;
+			}
+		}
+
+		// Every box is down to one color.
+		if (split == boxes.size())
+			break;
+
+		auto &box = boxes[split];
+		int channel = box.channel;
+		std::sort(entries.begin() + box.begin, entries.begin() + box.end,
+		          [channel](const HistogramEntry &a, const HistogramEntry &b) {
+			          int channels_a[4], channels_b[4];
+			          unpack_channels(a.color, channels_a);
+			          unpack_channels(b.color, channels_b);
+			          return channels_a[channel] < channels_b[channel];
+		          });
+
+		// Weighted median, which leaves at least one color on either side.
+		uint64_t accum = 0;
+		size_t mid = box.begin + 1;
+		for (size_t i = box.begin; i + 1 < box.end; i++)
+		{
+			accum += entries[i].count;
+			mid = i + 1;
+			if (2 * accum >= box.count)
+				break;
+		}
+
+		ColorBox upper = { mid, box.end };
+		box.end = mid;
+		analyze_box(entries, box);
+		analyze_box(entries, upper);
+		boxes.push_back(upper);
+	}
+
+	palette.assign(num_colors, 0);
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		auto &box = boxes[i];
+		uint64_t sums[4] = {};
+		for (size_t j = box.begin; j < box.end; j++)
+		{
+			int channels[4];
+			unpack_channels(entries[j].color, channels);
+			for (unsigned c = 0; c < 4; c++)
+				sums[c] += uint64_t(channels[c]) * entries[j].count;
+		}
+
+		// Expanded the same way the sampler expands ARGB1555.
+		uint32_t rgb[3];
+		for (unsigned c = 0; c < 3; c++)
+		{
+			uint32_t v = uint32_t((sums[c] + box.count / 2) / box.count);
+			rgb[c] = (v << 3) | (v >> 2);
+		}
+		bool opaque = 2 * sums[3] >= 31 * box.count;
+		palette[i] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16) | (opaque ? 0xff000000u : 0u);
+	}
+
+	index_cache.assign(0x10000, INVALID_INDEX);
+}
+
+const std::vector<uint32_t> &PaletteQuantizer::get_palette() const
+{
+	return palette;
+}
+
+uint8_t PaletteQuantizer::get_index(uint32_t pixel)
+{
+	assert(!palette.empty());
+	uint32_t color = rgba8888_to_argb1555(pixel);
+	uint16_t &index = index_cache[color];
+	if (index != INVALID_INDEX)
+		return uint8_t(index);
+
+	int channels[4];
+	unpack_channels(color, channels);
+
+	int best_dist = std::numeric_limits<int>::max();
+	for (size_t i = 0; i < palette.size(); i++)
+	{
+		int entry[4];
+		unpack_channels(rgba8888_to_argb1555(palette[i]), entry);
+
+		int dist = 0;
+		for (unsigned c = 0; c < 4; c++)
+			dist += (channels[c] - entry[c]) * (channels[c] - entry[c]);
+
+		if (dist < best_dist)
+		{
+			best_dist = dist;
+			index = uint16_t(i);
+		}
+	}
+
+	return uint8_t(index);
+}
+
+// Packs the four ARGB1555 texels of the 2x2 block at x, y, clamping to the image.
+static uint64_t fetch_block(const uint32_t *pixels, unsigned width, unsigned height, unsigned x, unsigned y)
+{
+	unsigned x1 = std::min(x + 1, width - 1);
+	unsigned y1 = std::min(y + 1, height - 1);
+	uint64_t block = rgba8888_to_argb1555(pixels[y * width + x]);
+	block |= uint64_t(rgba8888_to_argb1555(pixels[y * width + x1])) << 16;
+	block |= uint64_t(rgba8888_to_argb1555(pixels[y1 * width + x])) << 32;
+	block |= uint64_t(rgba8888_to_argb1555(pixels[y1 * width + x1])) << 48;
+	return block;
+}
+
+static void unpack_block_channels(uint64_t block, float (&channels)[VQ_CHANNELS])
+{
+	for (unsigned texel = 0; texel < VectorQuantizer::BLOCK_TEXELS; texel++)
+	{
+		int texel_channels[4];
+		unpack_channels(uint32_t(block >> (16 * texel)) & 0xffff, texel_channels);
+		for (unsigned c = 0; c < 4; c++)
+			channels[4 * texel + c] = float(texel_channels[c]);
+	}
+}
+
+static float block_distance(const float *a, const float *b)
+{
+	float dist = 0.0f;
+	for (unsigned c = 0; c < VQ_CHANNELS; c++)
+		dist += (a[c] - b[c]) * (a[c] - b[c]);
+	return dist;
+}
+
+static size_t find_nearest_block(const std::vector<float> &centroids, const float *channels, float &best_dist)
+{
+	size_t best = 0;
+	best_dist = std::numeric_limits<float>::max();
+	for (size_t i = 0; i < centroids.size() / VQ_CHANNELS; i++)
+	{
+		float dist = block_distance(&centroids[i * VQ_CHANNELS], channels);
+		if (dist < best_dist)
+		{
+			best_dist = dist;
+			best = i;
+		}
+	}
+	return best;
+}
+
+void VectorQuantizer::add_image(const uint32_t *pixels, unsigned width, unsigned height)
+{
+	for (unsigned y = 0; y < height; y += 2)
+		for (unsigned x = 0; x < width; x += 2)
+			histogram[fetch_block(pixels, width, height, x, y)]++;
+}
+
+void VectorQuantizer::build_codebook()
+{
+	std::vector<BlockEntry> entries;
+	entries.reserve(histogram.size());
+	for (auto &entry : histogram)
+		entries.push_back({ entry.first, entry.second });
+
+	// Hash order is not stable across implementations.
+	std::sort(entries.begin(), entries.end(), [](const BlockEntry &a, const BlockEntry &b) {
+		return a.block < b.block;
+	});
+
+	if (entries.size() > VQ_MAX_TRAINING_BLOCKS)
+	{
+		size_t stride = (entries.size() + VQ_MAX_TRAINING_BLOCKS - 1) / VQ_MAX_TRAINING_BLOCKS;
+		size_t count = 0;
+		for (size_t i = 0; i < entries.size(); i += stride)
+			entries[count++] = entries[i];
+		entries.resize(count);
+	}
+
+	for (auto &entry : entries)
+		unpack_block_channels(entry.block, entry.channels);
+
+	// Seed with blocks spread evenly over brightness, or every block if they all fit.
+	std::sort(entries.begin(), entries.end(), [](const BlockEntry &a, const BlockEntry &b) {
+		float sum_a = 0.0f, sum_b = 0.0f;
+		for (unsigned c = 0; c < VQ_CHANNELS; c++)
+		{
+			sum_a += a.channels[c];
+			sum_b += b.channels[c];
+		}
+		return sum_a < sum_b;
+	});
+
+	size_t num_centroids = std::min<size_t>(entries.size(), CODEBOOK_SIZE);
+	std::vector<float> centroids(num_centroids * VQ_CHANNELS);
+	for (size_t i = 0; i < num_centroids; i++)
+	{
+		auto &seed = entries[(2 * i + 1) * entries.size() / (2 * num_centroids)];
+		std::copy(seed.channels, seed.channels + VQ_CHANNELS, &centroids[i * VQ_CHANNELS]);
+	}
+
+	for (unsigned iteration = 0; entries.size() > CODEBOOK_SIZE && iteration < VQ_TRAINING_ITERATIONS; iteration++)
+	{
+		std::vector<double> sums(centroids.size());
+		std::vector<uint64_t> counts(num_centroids);
+		std::vector<float> errors(entries.size());
+
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			auto &entry = entries[i];
+			float dist;
+			size_t nearest = find_nearest_block(centroids, entry.channels, dist);
+			for (unsigned c = 0; c < VQ_CHANNELS; c++)
+				sums[nearest * VQ_CHANNELS + c] += double(entry.channels[c]) * entry.count;
+			counts[nearest] += entry.count;
+			errors[i] = dist * entry.count;
+		}
+
+		// Worst represented blocks first, each one reseeds at most one unused entry.
+		size_t num_unused = size_t(std::count(counts.begin(), counts.end(), 0));
+		std::vector<size_t> worst(entries.size());
+		for (size_t i = 0; i < worst.size(); i++)
+			worst[i] = i;
+		std::partial_sort(worst.begin(), worst.begin() + num_unused, worst.end(), [&errors](size_t a, size_t b) {
+			return errors[a] > errors[b];
+		});
+		size_t next_worst = 0;
+
+		for (size_t i = 0; i < num_centroids; i++)
+		{
+			float *centroid = &centroids[i * VQ_CHANNELS];
+			if (counts[i])
+			{
+				for (unsigned c = 0; c < VQ_CHANNELS; c++)
+					centroid[c] = float(sums[i * VQ_CHANNELS + c] / double(counts[i]));
+			}
+			else
+			{
+				// Move unused entries to the blocks which are represented worst.
+				auto &seed = entries[worst[next_worst++]];
+				std::copy(seed.channels, seed.channels + VQ_CHANNELS, centroid);
+			}
+		}
+	}
+
+	// Expanded the same way the sampler expands ARGB1555.
+	codebook.assign(CODEBOOK_SIZE * BLOCK_TEXELS, 0);
+	for (size_t i = 0; i < num_centroids * BLOCK_TEXELS; i++)
+	{
+		const float *texel = &centroids[i * 4];
+		uint32_t rgb[3];
+		for (unsigned c = 0; c < 3; c++)
+		{
+			uint32_t v = std::min(uint32_t(texel[c] + 0.5f), 31u);
+			rgb[c] = (v << 3) | (v >> 2);
+		}
+		bool opaque = texel[3] >= 15.5f;
+		codebook[i] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16) | (opaque ? 0xff000000u : 0u);
+	}
+
+	index_cache.clear();
+}
+
+const std::vector<uint32_t> &VectorQuantizer::get_codebook() const
+{
+	return codebook;
+}
+
+void VectorQuantizer::encode_image(const uint32_t *pixels, unsigned width, unsigned height, uint32_t *indices)
+{
+	assert(!codebook.empty());
+
+	// Match against the codebook as stored, not the unquantized centroids.
+	std::vector<float> entries(CODEBOOK_SIZE * VQ_CHANNELS);
+	for (unsigned i = 0; i < CODEBOOK_SIZE; i++)
+	{
+		uint64_t block = 0;
+		for (unsigned texel = 0; texel < BLOCK_TEXELS; texel++)
+			block |= uint64_t(rgba8888_to_argb1555(codebook[i * BLOCK_TEXELS + texel])) << (16 * texel);
+
+		float channels[VQ_CHANNELS];
+		unpack_block_channels(block, channels);
+		std::copy(channels, channels + VQ_CHANNELS, &entries[i * VQ_CHANNELS]);
+	}
+
+	for (unsigned y = 0; y < height; y += 2)
+	{
+		for (unsigned x = 0; x < width; x += 2)
+		{
+			uint64_t block = fetch_block(pixels, width, height, x, y);
+			auto itr = index_cache.find(block);
+			if (itr == index_cache.end())
+			{
+				float channels[VQ_CHANNELS];
+				unpack_block_channels(block, channels);
+				float dist;
+				itr = index_cache.insert({ block, uint8_t(find_nearest_block(entries, channels, dist)) }).first;
+			}
+			*indices++ = itr->second;
+		}
+	}
+}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+
+// Reduces RGBA8888 images to a small palette for the CLUT texture formats,
+// or to a codebook of 2x2 texel blocks for the VQ texture format.
+// Colors are first quantized to ARGB1555, which is what the CLUT and codebook store.
+
+namespace RetroWarp
+{
+class PaletteQuantizer
+{
+public:
+	PaletteQuantizer();
+
+	// Pixels of every image which will share the palette, e.g. all levels of a mip chain.
+	void add_pixels(const uint32_t *pixels, size_t count);
+
+	// At most 256 colors. Entries past the number of distinct colors are transparent black.
+	// The palette is RGBA8888 with colors which survive conversion to ARGB1555 unchanged.
+	void build_palette(unsigned num_colors);
+	const std::vector<uint32_t> &get_palette() const;
+
+	// Nearest palette entry, only valid after build_palette().
+	uint8_t get_index(uint32_t pixel);
+
+private:
+	// Pixel counts indexed by ARGB1555 color.
+	std::vector<uint32_t> histogram;
+	std::vector<uint32_t> palette;
+	// Nearest palette entry by ARGB1555 color, filled on demand.
+	std::vector<uint16_t> index_cache;
+};
+
+// Trains the codebook with k-means over the distinct blocks.
+class VectorQuantizer
+{
+public:
+	// Number of codebook entries.
+	static constexpr unsigned CODEBOOK_SIZE = 256;
+	// Texels per codebook entry, top-left, top-right, bottom-left, bottom-right.
+	static constexpr unsigned BLOCK_TEXELS = 4;
+
+	// Blocks of every image which will share the codebook. Odd sizes clamp to the last row or column.
+	void add_image(const uint32_t *pixels, unsigned width, unsigned height);
+
+	// The codebook is RGBA8888 with colors which survive conversion to ARGB1555 unchanged,
+	// CODEBOOK_SIZE * BLOCK_TEXELS texels. Unused entries are transparent black.
+	void build_codebook();
+	const std::vector<uint32_t> &get_codebook() const;
+
+	// Writes one index per 2x2 block, (width + 1) / 2 by (height + 1) / 2, only valid after build_codebook().
+	void encode_image(const uint32_t *pixels, unsigned width, unsigned height, uint32_t *indices);
+
+private:
+	// Pixel counts indexed by the four ARGB1555 texels of a block.
+	std::unordered_map<uint64_t, uint32_t> histogram;
+	std::vector<uint32_t> codebook;
+	// Nearest codebook entry by block, filled on demand.
+	std::unordered_map<uint64_t, uint8_t> index_cache;
+};
+}
@@ -85,6 +85,26 @@ static int32_t round_away_from_zero_divide(int32_t x, int32_t y)
 	return x / y;
 }
 
+void compute_primitive_bbox(PrimitiveSetup &setup)
+{
+	constexpr int raster_rounding = (1 << (SUBPIXELS_LOG2 + 16)) - 1;
+
+	// The span equations are linear in Y, so the extremes are found at the end points of each edge.
+	int end_point_a = setup.pos.x_a + setup.pos.dxdy_a * (setup.pos.y_hi - setup.pos.y_lo);
+	int end_point_b = setup.pos.x_b + setup.pos.dxdy_b * (setup.pos.y_mid - setup.pos.y_lo);
+	int end_point_c = setup.pos.x_c + setup.pos.dxdy_c * (setup.pos.y_hi - setup.pos.y_mid);
+
+	int lo_x = std::min(std::min(setup.pos.x_a, setup.pos.x_b), setup.pos.x_c);
+	int hi_x = std::max(std::max(setup.pos.x_a, setup.pos.x_b), setup.pos.x_c);
+	lo_x = std::min(lo_x, std::min(std::min(end_point_a, end_point_b), end_point_c));
+	hi_x = std::max(hi_x, std::max(std::max(end_point_a, end_point_b), end_point_c));
+
+	setup.bbox.min_x = int16_t((lo_x + raster_rounding) >> (16 + SUBPIXELS_LOG2));
+	setup.bbox.max_x = int16_t((hi_x - 1) >> (16 + SUBPIXELS_LOG2));
+	setup.bbox.min_y = int16_t((setup.pos.y_lo + (1 << SUBPIXELS_LOG2) - 1) >> SUBPIXELS_LOG2);
+	setup.bbox.max_y = int16_t((setup.pos.y_hi - 1) >> SUBPIXELS_LOG2);
+}
+
 static bool setup_triangle(PrimitiveSetup &setup, const InputPrimitive &input, CullMode cull_mode)
 {
 	setup = {};
@@ -210,6 +230,7 @@ static bool setup_triangle(PrimitiveSetup &setup, const InputPrimitive &input, C
 	setup.attr.u_offset = input.u_offset;
 	setup.attr.v_offset = input.v_offset;
 
+	compute_primitive_bbox(setup);
 	return true;
 }
 
@@ -47,5 +47,9 @@ struct ViewportTransform
 	float max_depth;
 };
 
+// Recomputes setup.bbox from setup.pos. setup_clipped_triangles() already does this,
+// it is only needed for primitives which were serialized without a bounding box.
+void compute_primitive_bbox(PrimitiveSetup &setup);
+
 unsigned setup_clipped_triangles(PrimitiveSetup prim[8], const InputPrimitive &input, CullMode mode, const ViewportTransform &vp);
 }
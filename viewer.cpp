@@ -14,6 +14,7 @@
 #include "gltf.hpp"
 #include "camera.hpp"
 #include "rasterizer_gpu.hpp"
+#include "frame_encoder.hpp"
 #include "os_filesystem.hpp"
 #include "scene_loader.hpp"
 #include "mesh_util.hpp"
@@ -32,6 +33,8 @@ struct SoftwareRenderableComponent : ComponentBase
 	std::vector<Vertex> vertices;
 	std::vector<Vertex> transformed_vertices;
 	std::vector<uvec3> indices;
+	// Static copy of vertices for transforming on the GPU.
+	VertexBufferHandle vertex_buffer;
 	SceneFormats::MemoryMappedTexture color_texture;
 	unsigned state_index;
 };
@@ -39,7 +42,10 @@ struct SoftwareRenderableComponent : ComponentBase
 struct SWRenderApplication : Application, EventHandler
 {
 	explicit SWRenderApplication(const std::string &path, bool subgroup, bool ubershader, bool async_compute,
-	                             unsigned width, unsigned height, unsigned tile_size);
+	                             unsigned width, unsigned height, unsigned tile_size, unsigned max_primitives,
+	                             unsigned batches_in_flight, bool direct_scanout, bool gpu_setup, bool gpu_transform,
+	                             bool deferred, bool adaptive_tile_size, TextureFormatBits texture_format,
+	                             const std::string &capture_path, FrameEncoder::Format capture_format);
 	void render_frame(double, double) override;
 
 	SceneLoader loader;
@@ -69,16 +75,38 @@ struct SWRenderApplication : Application, EventHandler
 	};
 	std::vector<Cached> setup_cache;
 	bool update_setup_cache = true;
+	void rasterize_setup_cache();
+	void apply_pipeline_state(DrawPipeline pipeline);
+	CommandList frozen_list;
+	bool frozen_list_valid = false;
 	bool subgroup;
 	bool ubershader;
 	bool async_compute;
 	unsigned fb_width;
 	unsigned fb_height;
 	unsigned tile_size;
+	unsigned max_primitives;
+	unsigned batches_in_flight;
+	bool direct_scanout;
+	// Clip and set up triangles on the GPU rather than filling the setup cache on the CPU.
+	bool gpu_setup;
+	// Also transform and light vertices on the GPU. Implies gpu_setup.
+	bool gpu_transform;
+	bool deferred;
+	bool adaptive_tile_size;
+	// Format of textures in VRAM. Paletted and VQ formats are quantized on creation.
+	TextureFormatBits texture_format;
+
+	// Every frame is read back and encoded in the background when capture_path is set.
+	std::string capture_path;
+	FrameEncoder::Format capture_format;
+	std::unique_ptr<FrameEncoder> frame_encoder;
+	unsigned capture_index = 0;
+	void capture_frame();
 
 	std::unordered_map<std::string, unsigned> state_index_map;
 	std::vector<const Vulkan::TextureFormatLayout *> state_index_layout;
-	std::vector<TextureDescriptor> texture_descriptors;
+	std::vector<TextureHandle> textures;
 	void create_software_renderable(Entity *entity, RenderableComponent *renderable);
 };
 
@@ -202,16 +230,22 @@ void SWRenderApplication::create_software_renderable(Entity *entity, RenderableC
 
 void SWRenderApplication::on_device_created(const Vulkan::DeviceCreatedEvent& e)
 {
-	rasterizer_gpu.init(e.get_device(), subgroup, ubershader, async_compute, tile_size);
+	rasterizer_gpu.init(e.get_device(), subgroup, ubershader, async_compute, tile_size, max_primitives,
+	                    batches_in_flight);
+	rasterizer_gpu.set_deferred_shading(deferred);
+	rasterizer_gpu.set_adaptive_tile_size(adaptive_tile_size);
 	rasterizer_gpu.set_rop_state(BlendState::Replace);
 	rasterizer_gpu.set_depth_state(DepthTest::LE, DepthWrite::On);
 	rasterizer_gpu.set_combiner_mode(COMBINER_MODE_TEX_MOD_COLOR | COMBINER_SAMPLE_BIT);
 
-	uint32_t addr = 0;
-	rasterizer_gpu.set_color_framebuffer(addr, fb_width, fb_height, fb_width * 2);
-	addr += fb_width * fb_height * 2;
-	rasterizer_gpu.set_depth_framebuffer(addr, fb_width, fb_height, fb_width * 2);
-	addr += fb_width * fb_height * 2;
+	uint32_t color_addr = 0, depth_addr = 0;
+	if (!rasterizer_gpu.allocate_vram(fb_width * fb_height * 2, 64, color_addr) ||
+	    !rasterizer_gpu.allocate_vram(fb_width * fb_height * 2, 64, depth_addr))
+	{
+		throw std::runtime_error("Failed to allocate framebuffers in VRAM.");
+	}
+	rasterizer_gpu.set_color_framebuffer(color_addr, fb_width, fb_height, fb_width * 2);
+	rasterizer_gpu.set_depth_framebuffer(depth_addr, fb_width, fb_height, fb_width * 2);
 
 	unsigned num_textures = state_index_layout.size();
 	for (unsigned i = 0; i < num_textures; i++)
@@ -220,7 +254,7 @@ void SWRenderApplication::on_device_created(const Vulkan::DeviceCreatedEvent& e)
 		auto &layout = texture.get_layout();
 		unsigned levels = std::min(layout.get_levels() - TEXTURE_BASE_LEVEL, 8u);
 
-		TextureFormatBits fmt = TEXTURE_FMT_ARGB1555;
+		TextureFormatBits fmt = texture_format;
 		TextureDescriptor descriptor;
 		descriptor.texture_fmt = fmt | TEXTURE_FMT_FILTER_MIP_LINEAR_BIT | TEXTURE_FMT_FILTER_LINEAR_BIT;
 		descriptor.texture_clamp = i16vec4(-0x8000, -0x8000, 0x7fff, 0x7fff);
@@ -229,31 +263,66 @@ void SWRenderApplication::on_device_created(const Vulkan::DeviceCreatedEvent& e)
 		descriptor.texture_max_lod = levels - 1;
 		descriptor.texture_width = layout.get_width(TEXTURE_BASE_LEVEL);
 
-		addr = (addr + 63) & ~63;
-
+		TextureLevel texture_levels[8];
 		for (unsigned level = 0; level < levels; level++)
 		{
-			unsigned mip_width = layout.get_width(level + TEXTURE_BASE_LEVEL);
-			unsigned mip_height = layout.get_height(level + TEXTURE_BASE_LEVEL);
-			descriptor.texture_offset[level] = addr;
-
-			uint32_t blocks_width = (mip_width + 7) / 8;
-			uint32_t blocks_height = (mip_height + 7) / 8;
-
-			rasterizer_gpu.copy_texture_rgba8888_to_vram(addr,
-			                                             static_cast<const uint32_t *>(layout.data(0, level + TEXTURE_BASE_LEVEL)),
-			                                             mip_width, mip_height, fmt);
-			addr += blocks_width * blocks_height * 64 * sizeof(uint16_t);
+			texture_levels[level].data = static_cast<const uint32_t *>(layout.data(0, level + TEXTURE_BASE_LEVEL));
+			texture_levels[level].width = layout.get_width(level + TEXTURE_BASE_LEVEL);
+			texture_levels[level].height = layout.get_height(level + TEXTURE_BASE_LEVEL);
 		}
 
-		texture_descriptors.push_back(descriptor);
+		// Uploaded to VRAM on first use.
+		textures.push_back(rasterizer_gpu.create_texture(descriptor, texture_levels, levels));
 	}
 
-	LOGI("Allocated %u bytes.\n", addr);
+	LOGI("Created %u textures.\n", num_textures);
+
+	if (gpu_transform)
+	{
+		auto &sw_renderables = loader.get_scene().get_entity_pool().get_component_group<SoftwareRenderableComponent>();
+		for (auto &renderable : sw_renderables)
+		{
+			auto *sw = get_component<SoftwareRenderableComponent>(renderable);
+			if (sw->vertices.empty())
+				continue;
+
+			// Normals are stored in the color of the untransformed vertices.
+			std::vector<StaticVertex> static_vertices(sw->vertices.size());
+			for (size_t i = 0; i < sw->vertices.size(); i++)
+			{
+				auto &v = sw->vertices[i];
+				memcpy(static_vertices[i].position, v.clip, 3 * sizeof(float));
+				memcpy(static_vertices[i].normal, v.color, 3 * sizeof(float));
+				static_vertices[i].u = v.u;
+				static_vertices[i].v = v.v;
+			}
+			sw->vertex_buffer = rasterizer_gpu.create_vertex_buffer(static_vertices.data(), unsigned(static_vertices.size()));
+		}
+	}
 }
 
 void SWRenderApplication::on_device_destroyed(const Vulkan::DeviceCreatedEvent &)
 {
+	if (frame_encoder)
+	{
+		rasterizer_gpu.wait_readbacks();
+		frame_encoder->wait_idle();
+		if (!frame_encoder->get_status())
+			LOGE("Failed to write one or more captured frames.\n");
+	}
+}
+
+void SWRenderApplication::capture_frame()
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s.%06u.%s", capture_path.c_str(), capture_index++,
+	         capture_format == FrameEncoder::Format::PNG ? "png" : "rgba");
+
+	std::string frame_path = path;
+	rasterizer_gpu.read_canvas_async([this, frame_path](std::vector<uint16_t> pixels, unsigned width, unsigned height) {
+		frame_encoder->push(frame_path, capture_format, std::move(pixels), width, height);
+	});
+	rasterizer_gpu.poll_readbacks();
 }
 
 void SWRenderApplication::begin_dump_frame()
@@ -313,7 +382,8 @@ void SWRenderApplication::dump_primitives(const PrimitiveSetup *setup, unsigned
 	for (unsigned i = 0; i < count; i++)
 	{
 		fwrite("PRIM", 1, 4, dump_file);
-		fwrite(&setup[i], 1, sizeof(PrimitiveSetup), dump_file);
+		fwrite(&setup[i].pos, 1, sizeof(PrimitiveSetupPos), dump_file);
+		fwrite(&setup[i].attr, 1, sizeof(PrimitiveSetupAttr), dump_file);
 	}
 }
 
@@ -325,10 +395,23 @@ void SWRenderApplication::end_dump_frame()
 }
 
 SWRenderApplication::SWRenderApplication(const std::string &path, bool subgroup_, bool ubershader_, bool async_compute_,
-                                         unsigned width_, unsigned height_, unsigned tile_size_)
+                                         unsigned width_, unsigned height_, unsigned tile_size_,
+                                         unsigned max_primitives_, unsigned batches_in_flight_,
+                                         bool direct_scanout_, bool gpu_setup_, bool gpu_transform_, bool deferred_,
+                                         bool adaptive_tile_size_, TextureFormatBits texture_format_,
+                                         const std::string &capture_path_, FrameEncoder::Format capture_format_)
 		: subgroup(subgroup_), ubershader(ubershader_), async_compute(async_compute_),
-		  fb_width(width_), fb_height(height_), tile_size(tile_size_)
+		  fb_width(width_), fb_height(height_), tile_size(tile_size_), max_primitives(max_primitives_),
+		  batches_in_flight(batches_in_flight_), direct_scanout(direct_scanout_), gpu_setup(gpu_setup_),
+		  gpu_transform(gpu_transform_), deferred(deferred_), adaptive_tile_size(adaptive_tile_size_),
+		  texture_format(texture_format_), capture_path(capture_path_), capture_format(capture_format_)
 {
+	if (!capture_path.empty())
+	{
+		unsigned num_threads = std::max(std::thread::hardware_concurrency() / 2, 1u);
+		frame_encoder.reset(new FrameEncoder(num_threads, 2 * num_threads));
+	}
+
 	loader.load_scene(path);
 	get_wsi().set_backbuffer_srgb(false);
 
@@ -354,17 +437,28 @@ bool SWRenderApplication::on_key_pressed(const KeyboardEvent &e)
 	if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::C)
 		queue_dump_frame = true;
 	else if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::U)
+	{
 		update_setup_cache = !update_setup_cache;
+		if (update_setup_cache && frozen_list_valid)
+		{
+			rasterizer_gpu.destroy_command_list(frozen_list);
+			frozen_list_valid = false;
+		}
+	}
 	else if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::Space)
 		get_wsi().set_present_mode(get_wsi().get_present_mode() == Vulkan::PresentMode::SyncToVBlank ? Vulkan::PresentMode::Unlocked : Vulkan::PresentMode::SyncToVBlank);
 	return true;
 }
 
+static const vec3 light_direction = vec3(0.6f, 0.8f, 0.4f);
+static constexpr float light_diffuse = 0.9f;
+static constexpr float light_ambient = 0.1f;
+
 static void transform_vertex(Vertex &out_vertex, const Vertex &in_vertex, const mat4 &mvp, const mat3 &normal_matrix)
 {
 	vec3 n = vec3(in_vertex.color[0], in_vertex.color[1], in_vertex.color[2]);
 	n = normalize(normal_matrix * n);
-	float ndotl = clamp(dot(n, vec3(0.6f, 0.8f, 0.4f)), 0.0f, 1.0f) * 0.9f + 0.1f;
+	float ndotl = clamp(dot(n, light_direction), 0.0f, 1.0f) * light_diffuse + light_ambient;
 
 	vec4 pos = vec4(in_vertex.x, in_vertex.y, in_vertex.z, 1.0f);
 	vec4 clip = mvp * pos;
@@ -375,12 +469,65 @@ static void transform_vertex(Vertex &out_vertex, const Vertex &in_vertex, const
 	memcpy(out_vertex.clip, clip.data, 4 * sizeof(float));
 }
 
+void SWRenderApplication::apply_pipeline_state(DrawPipeline pipeline)
+{
+	switch (pipeline)
+	{
+	case DrawPipeline::Opaque:
+		rasterizer_gpu.set_alpha_threshold(0);
+		rasterizer_gpu.set_rop_state(BlendState::Replace);
+		if (queue_dump_frame)
+		{
+			dump_alpha_threshold(0);
+			dump_rop_state(BlendState::Replace);
+		}
+		break;
+
+	case DrawPipeline::AlphaTest:
+		rasterizer_gpu.set_alpha_threshold(128);
+		rasterizer_gpu.set_rop_state(BlendState::Replace);
+		if (queue_dump_frame)
+		{
+			dump_alpha_threshold(128);
+			dump_rop_state(BlendState::Replace);
+		}
+		break;
+
+	case DrawPipeline::AlphaBlend:
+		rasterizer_gpu.set_alpha_threshold(0);
+		rasterizer_gpu.set_rop_state(BlendState::Alpha);
+		if (queue_dump_frame)
+		{
+			dump_alpha_threshold(0);
+			dump_rop_state(BlendState::Alpha);
+		}
+		break;
+	}
+}
+
+void SWRenderApplication::rasterize_setup_cache()
+{
+	for (auto &setup : setup_cache)
+	{
+		if (queue_dump_frame)
+			dump_set_texture(setup.index);
+
+		apply_pipeline_state(setup.pipeline);
+		if (!rasterizer_gpu.set_texture(textures[setup.index]))
+			LOGE("Texture %u does not fit in VRAM.\n", setup.index);
+		rasterizer_gpu.rasterize_primitives(&setup.setup, 1);
+		if (queue_dump_frame)
+			dump_primitives(&setup.setup, 1);
+	}
+}
+
 void SWRenderApplication::render_frame(double frame_time, double)
 {
 	auto &device = get_wsi().get_device();
 	auto &scene = loader.get_scene();
 	scene.update_cached_transforms();
 
+	rasterizer_gpu.next_frame();
 	rasterizer_gpu.clear_color();
 	rasterizer_gpu.clear_depth();
 
@@ -410,7 +557,15 @@ void SWRenderApplication::render_frame(double frame_time, double)
 		dump_textures(source_paths);
 	}
 
-	if (update_setup_cache)
+	// Dumps store set up primitives, so those frames are always set up on the CPU,
+	// from the frozen vertices if need be.
+	bool use_gpu_setup = gpu_setup && !queue_dump_frame;
+	bool use_gpu_transform = gpu_transform && use_gpu_setup;
+	bool update_cpu_setup = !use_gpu_setup && (update_setup_cache || gpu_setup);
+	// With GPU transforms, the CPU vertices are only transformed for dumps, with the current camera.
+	bool update_cpu_transform = gpu_transform ? !use_gpu_transform : update_setup_cache;
+
+	if (update_cpu_transform || update_cpu_setup)
 	{
 		setup_cache.clear();
 		for (auto &renderable : renderables)
@@ -429,9 +584,15 @@ void SWRenderApplication::render_frame(double frame_time, double)
 			//bool two_sided = false;
 			auto pipeline = static_mesh->material->pipeline;
 
-			size_t vertex_count = sw->vertices.size();
-			for (size_t i = 0; i < vertex_count; i++)
-				transform_vertex(sw->transformed_vertices[i], sw->vertices[i], mvp, n);
+			if (update_cpu_transform)
+			{
+				size_t vertex_count = sw->vertices.size();
+				for (size_t i = 0; i < vertex_count; i++)
+					transform_vertex(sw->transformed_vertices[i], sw->vertices[i], mvp, n);
+			}
+
+			if (!update_cpu_setup)
+				continue;
 
 			for (auto &primitive : sw->indices)
 			{
@@ -456,62 +617,92 @@ void SWRenderApplication::render_frame(double frame_time, double)
 			}
 		}
 	}
-	else
+	else if (!use_gpu_setup)
 		LOGI("Cached %u primitive setups!\n", unsigned(setup_cache.size()));
 
-	for (auto &setup : setup_cache)
-	{
-		if (queue_dump_frame)
-			dump_set_texture(setup.index);
+	// Triangles are clipped and set up on the GPU straight from the transformed vertices,
+	// or from the static vertex buffers with GPU transforms.
+	const auto rasterize_frame = [&]() {
+		if (!use_gpu_setup)
+		{
+			rasterize_setup_cache();
+			return;
+		}
 
-		auto pipeline = setup.pipeline;
-		switch (pipeline)
+		for (auto &renderable : renderables)
 		{
-		case DrawPipeline::Opaque:
-			rasterizer_gpu.set_alpha_threshold(0);
-			rasterizer_gpu.set_rop_state(BlendState::Replace);
-			if (queue_dump_frame)
-			{
-				dump_alpha_threshold(0);
-				dump_rop_state(BlendState::Replace);
-			}
-			break;
+			auto *sw = get_component<SoftwareRenderableComponent>(renderable);
+			auto *render = get_component<RenderableComponent>(renderable);
+			auto *static_mesh = dynamic_cast<ImportedMesh *>(render->renderable.get());
+			if (!static_mesh)
+				continue;
+
+			apply_pipeline_state(static_mesh->material->pipeline);
+			if (!rasterizer_gpu.set_texture(textures[sw->state_index]))
+				LOGE("Texture %u does not fit in VRAM.\n", sw->state_index);
+
+			static_assert(sizeof(uvec3) == 3 * sizeof(uint32_t), "Indices must be tightly packed.");
+			auto *indices = reinterpret_cast<const uint32_t *>(sw->indices.data());
+			auto cull_mode = static_mesh->material->two_sided ? CullMode::None : CullMode::CCWOnly;
 
-		case DrawPipeline::AlphaTest:
-			rasterizer_gpu.set_alpha_threshold(128);
-			rasterizer_gpu.set_rop_state(BlendState::Replace);
-			if (queue_dump_frame)
+			if (use_gpu_transform)
 			{
-				dump_alpha_threshold(128);
-				dump_rop_state(BlendState::Replace);
+				if (sw->vertex_buffer.index == ~0u)
+					continue;
+
+				auto &m = get_component<RenderInfoComponent>(renderable)->transform->world_transform;
+				VertexTransform transform;
+				transform.mvp = vp * m;
+				transform.normal_matrix = mat3(m);
+				transform.light_direction = light_direction;
+				transform.diffuse = light_diffuse;
+				transform.ambient = light_ambient;
+				rasterizer_gpu.rasterize_triangles(sw->vertex_buffer, transform, indices, unsigned(sw->indices.size()),
+				                                   cull_mode, viewport_transform);
 			}
-			break;
-
-		case DrawPipeline::AlphaBlend:
-			rasterizer_gpu.set_alpha_threshold(0);
-			rasterizer_gpu.set_rop_state(BlendState::Alpha);
-			if (queue_dump_frame)
+			else
 			{
-				dump_alpha_threshold(0);
-				dump_rop_state(BlendState::Alpha);
+				rasterizer_gpu.rasterize_triangles(sw->transformed_vertices.data(),
+				                                   unsigned(sw->transformed_vertices.size()), indices,
+				                                   unsigned(sw->indices.size()), cull_mode, viewport_transform);
 			}
-			break;
 		}
+	};
 
-		rasterizer_gpu.set_texture_descriptor(texture_descriptors[setup.index]);
-		rasterizer_gpu.rasterize_primitives(&setup.setup, 1);
-		if (queue_dump_frame)
-			dump_primitives(&setup.setup, 1);
+	// While frozen, the frame is recorded once and replayed without any per-primitive CPU work.
+	bool use_command_list = !update_setup_cache && !queue_dump_frame;
+	if (!use_command_list)
+		rasterize_frame();
+	else
+	{
+		if (!frozen_list_valid)
+		{
+			rasterizer_gpu.begin_command_list();
+			rasterize_frame();
+			frozen_list = rasterizer_gpu.end_command_list();
+			frozen_list_valid = true;
+		}
+		rasterizer_gpu.execute_command_list(frozen_list);
 	}
 
-	auto image_gpu = rasterizer_gpu.copy_to_framebuffer();
+	if (frame_encoder)
+		capture_frame();
 
-	auto cmd = device.request_command_buffer();
-	cmd->begin_render_pass(device.get_swapchain_render_pass(Vulkan::SwapchainRenderPass::ColorOnly));
-	cmd->set_texture(0, 0, image_gpu->get_view(), Vulkan::StockSampler::LinearClamp);
-	Vulkan::CommandBufferUtil::draw_fullscreen_quad(*cmd, "builtin://shaders/quad.vert", "builtin://shaders/blit.frag");
-	cmd->end_render_pass();
-	device.submit(cmd);
+	if (direct_scanout)
+	{
+		rasterizer_gpu.scanout(device.get_swapchain_render_pass(Vulkan::SwapchainRenderPass::ColorOnly));
+	}
+	else
+	{
+		auto image_gpu = rasterizer_gpu.copy_to_framebuffer();
+
+		auto cmd = device.request_command_buffer();
+		cmd->begin_render_pass(device.get_swapchain_render_pass(Vulkan::SwapchainRenderPass::ColorOnly));
+		cmd->set_texture(0, 0, image_gpu->get_view(), Vulkan::StockSampler::LinearClamp);
+		Vulkan::CommandBufferUtil::draw_fullscreen_quad(*cmd, "builtin://shaders/quad.vert", "builtin://shaders/blit.frag");
+		cmd->end_render_pass();
+		device.submit(cmd);
+	}
 
 	if (queue_dump_frame)
 		end_dump_frame();
@@ -531,6 +722,16 @@ Application *application_create(int argc, char **argv)
 	unsigned width = 640;
 	unsigned height = 360;
 	unsigned tile_size = 8;
+	unsigned max_primitives = 0x4000;
+	unsigned batches_in_flight = 3;
+	bool direct_scanout = false;
+	bool gpu_setup = false;
+	bool gpu_transform = false;
+	bool deferred = false;
+	bool adaptive_tile_size = false;
+	std::string texture_format = "argb1555";
+	std::string capture_path;
+	std::string capture_format = "png";
 
 	Util::CLICallbacks cbs;
 	cbs.add("--ubershader", [&](Util::CLIParser &) { ubershader = true; });
@@ -539,6 +740,16 @@ Application *application_create(int argc, char **argv)
 	cbs.add("--width", [&](Util::CLIParser &parser) { width = parser.next_uint(); });
 	cbs.add("--height", [&](Util::CLIParser &parser) { height = parser.next_uint(); });
 	cbs.add("--tile-size", [&](Util::CLIParser &parser) { tile_size = parser.next_uint(); });
+	cbs.add("--max-primitives", [&](Util::CLIParser &parser) { max_primitives = parser.next_uint(); });
+	cbs.add("--batches-in-flight", [&](Util::CLIParser &parser) { batches_in_flight = parser.next_uint(); });
+	cbs.add("--direct-scanout", [&](Util::CLIParser &) { direct_scanout = true; });
+	cbs.add("--gpu-setup", [&](Util::CLIParser &) { gpu_setup = true; });
+	cbs.add("--gpu-transform", [&](Util::CLIParser &) { gpu_setup = true; gpu_transform = true; });
+	cbs.add("--deferred", [&](Util::CLIParser &) { deferred = true; });
+	cbs.add("--adaptive-tile-size", [&](Util::CLIParser &) { adaptive_tile_size = true; });
+	cbs.add("--texture-format", [&](Util::CLIParser &parser) { texture_format = parser.next_string(); });
+	cbs.add("--capture", [&](Util::CLIParser &parser) { capture_path = parser.next_string(); });
+	cbs.add("--capture-format", [&](Util::CLIParser &parser) { capture_format = parser.next_string(); });
 	cbs.default_handler = [&](const char *arg) { path = arg; };
 	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
 
@@ -554,7 +765,43 @@ Application *application_create(int argc, char **argv)
 		return nullptr;
 	}
 
+	if (max_primitives < 1024 || max_primitives > 262144 || (max_primitives & 1023) != 0)
+	{
+		LOGE("Max primitives must be a multiple of 1024 in range [1024, 262144].\n");
+		return nullptr;
+	}
+
+	if (batches_in_flight < 2 || batches_in_flight > 4)
+	{
+		LOGE("Batches in flight must be in range [2, 4].\n");
+		return nullptr;
+	}
+
+	if (capture_format != "png" && capture_format != "raw")
+	{
+		LOGE("Capture format must be png or raw.\n");
+		return nullptr;
+	}
+
+	TextureFormatBits texture_fmt;
+	if (texture_format == "argb1555")
+		texture_fmt = TEXTURE_FMT_ARGB1555;
+	else if (texture_format == "pal8")
+		texture_fmt = TEXTURE_FMT_PAL8;
+	else if (texture_format == "pal4")
+		texture_fmt = TEXTURE_FMT_PAL4;
+	else if (texture_format == "vq")
+		texture_fmt = TEXTURE_FMT_VQ;
+	else
+	{
+		LOGE("Texture format must be argb1555, pal8, pal4 or vq.\n");
+		return nullptr;
+	}
+
 	Global::filesystem()->register_protocol("assets", std::make_unique<OSFilesystem>(ASSET_DIRECTORY));
-	return new SWRenderApplication(path, subgroup, ubershader, async_compute, width, height, tile_size);
+	return new SWRenderApplication(path, subgroup, ubershader, async_compute, width, height, tile_size, max_primitives,
+	                               batches_in_flight, direct_scanout, gpu_setup, gpu_transform, deferred,
+	                               adaptive_tile_size, texture_fmt, capture_path,
+	                               capture_format == "png" ? FrameEncoder::Format::PNG : FrameEncoder::Format::Raw);
 }
 }
@@ -0,0 +1,99 @@
+#include "vram_allocator.hpp"
+#include <algorithm>
+#include <assert.h>
+
+namespace RetroWarp
+{
+void VRAMAllocator::init(uint32_t size)
+{
+	free_ranges.clear();
+	allocations.clear();
+	if (size)
+		free_ranges.push_back({ 0, size });
+}
+
+bool VRAMAllocator::allocate(uint32_t size, uint32_t alignment, uint32_t &offset)
+{
+	assert((alignment & (alignment - 1)) == 0);
+	if (size == 0)
+		return false;
+
+	for (auto itr = free_ranges.begin(); itr != free_ranges.end(); ++itr)
+	{
+		uint32_t aligned_offset = (itr->offset + alignment - 1) & ~(alignment - 1);
+		uint32_t padding = aligned_offset - itr->offset;
+		if (padding > itr->size || itr->size - padding < size)
+			continue;
+
+		uint32_t tail_offset = aligned_offset + size;
+		uint32_t tail_size = itr->size - padding - size;
+
+		// Keep the alignment padding as its own free range in place of the old one.
+		if (padding != 0)
+		{
+			itr->size = padding;
+			if (tail_size != 0)
+				free_ranges.insert(itr + 1, { tail_offset, tail_size });
+		}
+		else if (tail_size != 0)
+		{
+			itr->offset = tail_offset;
+			itr->size = tail_size;
+		}
+		else
+			free_ranges.erase(itr);
+
+		allocations[aligned_offset] = size;
+		offset = aligned_offset;
+		return true;
+	}
+
+	return false;
+}
+
+void VRAMAllocator::free(uint32_t offset)
+{
+	auto itr = allocations.find(offset);
+	assert(itr != allocations.end());
+	if (itr == allocations.end())
+		return;
+
+	uint32_t size = itr->second;
+	allocations.erase(itr);
+	release_range(offset, size);
+}
+
+void VRAMAllocator::release_range(uint32_t offset, uint32_t size)
+{
+	auto itr = std::lower_bound(free_ranges.begin(), free_ranges.end(), offset,
+	                            [](const Range &range, uint32_t value) { return range.offset < value; });
+	itr = free_ranges.insert(itr, { offset, size });
+
+	// Merge with next range.
+	auto next = itr + 1;
+	if (next != free_ranges.end() && itr->offset + itr->size == next->offset)
+	{
+		itr->size += next->size;
+		itr = free_ranges.erase(next) - 1;
+	}
+
+	// Merge with previous range.
+	if (itr != free_ranges.begin())
+	{
+		auto prev = itr - 1;
+		if (prev->offset + prev->size == itr->offset)
+		{
+			prev->size += itr->size;
+			free_ranges.erase(itr);
+		}
+	}
+}
+
+uint32_t VRAMAllocator::get_free_size() const
+{
+	uint32_t size = 0;
+	for (auto &range : free_ranges)
+		size += range.size;
+	return size;
+}
+}
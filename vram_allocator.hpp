@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+// First-fit sub-allocator for the fixed-size VRAM buffer.
+// Free ranges are kept sorted by offset and coalesced on free.
+
+namespace RetroWarp
+{
+class VRAMAllocator
+{
+public:
+	void init(uint32_t size);
+
+	// alignment must be power-of-two.
+	bool allocate(uint32_t size, uint32_t alignment, uint32_t &offset);
+	void free(uint32_t offset);
+
+	uint32_t get_free_size() const;
+
+private:
+	struct Range
+	{
+		uint32_t offset;
+		uint32_t size;
+	};
+	std::vector<Range> free_ranges;
+	std::unordered_map<uint32_t, uint32_t> allocations;
+
+	void release_range(uint32_t offset, uint32_t size);
+};
+}